@@ -0,0 +1,434 @@
+/*
+ * GStreamer
+ * Copyright (C) 2011 Fabrizio Gennari <fabrizio.ge@tiscali.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * SECTION:element-cswdec
+ *
+ * Reads a CSW (Compressed Square Wave) file and extracts its Commodore TAP
+ * stream. Versions 1 and 2 are supported, with RLE and, for version 2,
+ * Z-RLE compression, which is inflated as the data arrives.
+ *
+ * CSW stores the length of each level of the signal, so the output is
+ * always in half waves.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 filesrc location=tape.csw ! cswdec ! tapdec ! wavenc ! filesink location=tape.wav
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "gstcswdec.h"
+
+/* #defines don't like whitespacey bits */
+#define GST_TYPE_CSWDEC \
+  (gst_cswdec_get_type())
+#define GST_CSWDEC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_CSWDEC,GstCswDec))
+#define GST_CSWDEC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_CSWDEC,GstCswDecClass))
+#define GST_IS_CSWDEC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_CSWDEC))
+#define GST_IS_CSWDEC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_CSWDEC))
+
+typedef struct _GstCswDec GstCswDec;
+typedef struct _GstCswDecClass GstCswDecClass;
+
+struct _GstCswDec
+{
+  GstBaseTapContainerDec element;
+
+  guchar version;
+  gboolean in_header;
+  guchar compression;
+
+  /* bytes read from upstream, not used yet */
+  GByteArray *in;
+  guint in_pos;
+  /* with Z-RLE, the inflated bytes, not used yet */
+  z_stream zstream;
+  gboolean zstream_initialized;
+  gboolean zstream_end;
+  GByteArray *out;
+  guint out_pos;
+};
+
+struct _GstCswDecClass
+{
+  GstBaseTapContainerDecClass parent_class;
+};
+
+GST_DEBUG_CATEGORY_STATIC (gst_cswdec_debug);
+#define GST_CAT_DEFAULT gst_cswdec_debug
+
+G_DEFINE_TYPE (GstCswDec, gst_cswdec, GST_TYPE_BASETAPCONTAINERDEC);
+
+static gsize gst_cswdec_get_header_size (GstBaseTapContainerDec * filter);
+static GstBaseTapContainerHeaderStatus
+gst_cswdec_read_header (GstBaseTapContainerDec * filter,
+    const guint8 * header_data);
+static gboolean gst_cswdec_read_pulse (GstBaseTapContainerDec * filter,
+    GstBaseTapContainerReadData read_data, guint * pulse);
+
+static void
+gst_cswdec_reset (GstCswDec * decoder)
+{
+  if (decoder->zstream_initialized) {
+    inflateEnd (&decoder->zstream);
+    decoder->zstream_initialized = FALSE;
+  }
+  decoder->zstream_end = FALSE;
+  g_byte_array_set_size (decoder->in, 0);
+  decoder->in_pos = 0;
+  g_byte_array_set_size (decoder->out, 0);
+  decoder->out_pos = 0;
+}
+
+static void
+gst_cswdec_finalize (GObject * object)
+{
+  GstCswDec *decoder = GST_CSWDEC (object);
+
+  gst_cswdec_reset (decoder);
+  g_byte_array_free (decoder->in, TRUE);
+  g_byte_array_free (decoder->out, TRUE);
+
+  G_OBJECT_CLASS (gst_cswdec_parent_class)->finalize (object);
+}
+
+/* initialize the cswdec's class */
+static void
+gst_cswdec_class_init (GstCswDecClass * gclass)
+{
+  GstBaseTapContainerDecClass *parent_class =
+      GST_BASETAPCONTAINERDEC_CLASS (gclass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (gclass);
+  GObjectClass *gobject_class = G_OBJECT_CLASS (gclass);
+
+  gobject_class->finalize = gst_cswdec_finalize;
+
+  gst_element_class_set_details_simple (element_class,
+      "CSW (Compressed Square Wave) file reader",
+      "Codec/Parser/Audio",
+      "Reads TAP data from CSW files",
+      "Fabrizio Gennari <fabrizio.ge@tiscali.it>");
+
+  parent_class->get_header_size = gst_cswdec_get_header_size;
+  parent_class->read_header = gst_cswdec_read_header;
+  parent_class->read_pulse = gst_cswdec_read_pulse;
+
+  gst_basetapcontainerdec_sink_factory (parent_class, "audio/x-tap-csw");
+}
+
+/* The part of the header common to both versions, up to the rate. The
+ * rest is read before the first pulse */
+#define CSWDEC_HEADER_SIZE 29
+#define CSWDEC_V1_HEADER_REST 3
+#define CSWDEC_V2_HEADER_REST 23
+#define CSW_COMPRESSION_RLE 1
+#define CSW_COMPRESSION_Z_RLE 2
+#define CSWDEC_INFLATE_SIZE 65536
+
+static const char csw_signature[] = "Compressed Square Wave\x1a";
+
+static gsize
+gst_cswdec_get_header_size (GstBaseTapContainerDec * filter)
+{
+  return CSWDEC_HEADER_SIZE;
+}
+
+static GstBaseTapContainerHeaderStatus
+gst_cswdec_read_header (GstBaseTapContainerDec * filter,
+    const guint8 * header_data)
+{
+  GstCswDec *decoder = GST_CSWDEC (filter);
+
+  GST_DEBUG_OBJECT (filter, "Reading header");
+  if (memcmp (header_data, csw_signature, strlen (csw_signature)))
+    return GST_BASE_TAP_CONVERT_NO_VALID_HEADER;
+  header_data += strlen (csw_signature);
+  decoder->version = *header_data++;
+  header_data++;                /* minor version */
+  if (decoder->version == 1) {
+    filter->rate = GST_READ_UINT16_LE (header_data);
+    decoder->compression = header_data[2];
+  } else if (decoder->version == 2)
+    filter->rate = GST_READ_UINT32_LE (header_data);
+  else
+    return GST_BASE_TAP_CONVERT_NO_VALID_HEADER;
+  if (filter->rate == 0)
+    return GST_BASE_TAP_CONVERT_NO_VALID_HEADER;
+  filter->halfwaves = TRUE;
+
+  gst_cswdec_reset (decoder);
+  decoder->in_header = TRUE;
+
+  return GST_BASE_TAP_CONVERT_VALID_HEADER;
+}
+
+/* Input.
+ * read_data gives exactly the bytes asked for, or nothing, so the bytes are
+ * taken in chunks as big as available, and kept here until used. This way,
+ * a pulse or a part of the header split across two buffers is read whole
+ * next time, instead of being half consumed */
+
+static gboolean
+gst_cswdec_fill_in (GstCswDec * decoder, GstBaseTapContainerReadData read_data)
+{
+  guint chunk;
+
+  if (decoder->in_pos > 0) {
+    g_byte_array_remove_range (decoder->in, 0, decoder->in_pos);
+    decoder->in_pos = 0;
+  }
+  for (chunk = 4096; chunk > 0; chunk /= 16) {
+    const guint8 *data = read_data (GST_BASETAPCONTAINERDEC (decoder), chunk);
+
+    if (data != NULL) {
+      g_byte_array_append (decoder->in, data, chunk);
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+static gboolean
+gst_cswdec_ensure_in (GstCswDec * decoder,
+    GstBaseTapContainerReadData read_data, guint numbytes)
+{
+  while (decoder->in->len - decoder->in_pos < numbytes)
+    if (!gst_cswdec_fill_in (decoder, read_data))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* inflates some more data, returns FALSE if there is not enough input to
+ * get any */
+static gboolean
+gst_cswdec_inflate (GstCswDec * decoder, GstBaseTapContainerReadData read_data)
+{
+  if (decoder->out_pos > 0) {
+    g_byte_array_remove_range (decoder->out, 0, decoder->out_pos);
+    decoder->out_pos = 0;
+  }
+
+  while (!decoder->zstream_end) {
+    guint out_len = decoder->out->len;
+    guint in_avail = decoder->in->len - decoder->in_pos;
+    int ret;
+
+    if (in_avail == 0) {
+      if (!gst_cswdec_fill_in (decoder, read_data))
+        return FALSE;
+      in_avail = decoder->in->len;
+    }
+
+    g_byte_array_set_size (decoder->out, out_len + CSWDEC_INFLATE_SIZE);
+    decoder->zstream.next_in = decoder->in->data + decoder->in_pos;
+    decoder->zstream.avail_in = in_avail;
+    decoder->zstream.next_out = decoder->out->data + out_len;
+    decoder->zstream.avail_out = CSWDEC_INFLATE_SIZE;
+    ret = inflate (&decoder->zstream, Z_NO_FLUSH);
+    decoder->in_pos += in_avail - decoder->zstream.avail_in;
+    g_byte_array_set_size (decoder->out,
+        out_len + CSWDEC_INFLATE_SIZE - decoder->zstream.avail_out);
+
+    if (ret == Z_STREAM_END)
+      decoder->zstream_end = TRUE;
+    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      GST_ELEMENT_ERROR (decoder, STREAM, DECODE, (NULL),
+          ("cannot inflate CSW data: %s", decoder->zstream.msg ?
+              decoder->zstream.msg : "unknown error"));
+      GST_BASETAPCONTAINERDEC (decoder)->header_status =
+          GST_BASE_TAP_CONVERT_NO_VALID_HEADER;
+      return FALSE;
+    }
+    if (decoder->out->len > out_len)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* makes sure numbytes bytes of RLE data are available, and returns them */
+static const guint8 *
+gst_cswdec_peek (GstCswDec * decoder, GstBaseTapContainerReadData read_data,
+    guint numbytes)
+{
+  if (decoder->compression == CSW_COMPRESSION_RLE) {
+    if (!gst_cswdec_ensure_in (decoder, read_data, numbytes))
+      return NULL;
+    return decoder->in->data + decoder->in_pos;
+  }
+
+  while (decoder->out->len - decoder->out_pos < numbytes)
+    if (!gst_cswdec_inflate (decoder, read_data))
+      return NULL;
+
+  return decoder->out->data + decoder->out_pos;
+}
+
+static void
+gst_cswdec_consume (GstCswDec * decoder, guint numbytes)
+{
+  if (decoder->compression == CSW_COMPRESSION_RLE)
+    decoder->in_pos += numbytes;
+  else
+    decoder->out_pos += numbytes;
+}
+
+/* reads the part of the header after the rate, which differs between
+ * versions */
+static gboolean
+gst_cswdec_read_header_rest (GstCswDec * decoder,
+    GstBaseTapContainerReadData read_data)
+{
+  GstBaseTapContainerDec *filter = GST_BASETAPCONTAINERDEC (decoder);
+  const guint8 *rest;
+  guint rest_size;
+
+  if (decoder->version == 1)
+    rest_size = CSWDEC_V1_HEADER_REST;
+  else {
+    if (!gst_cswdec_ensure_in (decoder, read_data, CSWDEC_V2_HEADER_REST))
+      return FALSE;
+    rest = decoder->in->data + decoder->in_pos;
+    decoder->compression = rest[4];
+    /* fixed part, then the header extension */
+    rest_size = CSWDEC_V2_HEADER_REST + rest[6];
+  }
+  if (!gst_cswdec_ensure_in (decoder, read_data, rest_size))
+    return FALSE;
+  decoder->in_pos += rest_size;
+  decoder->in_header = FALSE;
+
+  GST_DEBUG_OBJECT (decoder, "version %u, compression %u", decoder->version,
+      decoder->compression);
+  if (decoder->compression == CSW_COMPRESSION_Z_RLE && decoder->version >= 2) {
+    memset (&decoder->zstream, 0, sizeof (decoder->zstream));
+    if (inflateInit (&decoder->zstream) != Z_OK) {
+      GST_ELEMENT_ERROR (decoder, LIBRARY, INIT, (NULL),
+          ("cannot initialize zlib"));
+      filter->header_status = GST_BASE_TAP_CONVERT_NO_VALID_HEADER;
+      return FALSE;
+    }
+    decoder->zstream_initialized = TRUE;
+  } else if (decoder->compression != CSW_COMPRESSION_RLE) {
+    GST_ELEMENT_ERROR (decoder, STREAM, CODEC_NOT_FOUND, (NULL),
+        ("unsupported CSW compression %u", decoder->compression));
+    filter->header_status = GST_BASE_TAP_CONVERT_NO_VALID_HEADER;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_cswdec_read_pulse (GstBaseTapContainerDec * filter,
+    GstBaseTapContainerReadData read_data, guint * pulse)
+{
+  GstCswDec *decoder = GST_CSWDEC (filter);
+  const guint8 *inbytes;
+
+  if (decoder->in_header && !gst_cswdec_read_header_rest (decoder, read_data))
+    return FALSE;
+
+  inbytes = gst_cswdec_peek (decoder, read_data, 1);
+  if (inbytes == NULL)
+    return FALSE;
+  if (inbytes[0] != 0) {
+    *pulse = inbytes[0];
+    gst_cswdec_consume (decoder, 1);
+    return TRUE;
+  }
+
+  /* a 0 is followed by a 32-bit length */
+  inbytes = gst_cswdec_peek (decoder, read_data, 5);
+  if (inbytes == NULL)
+    return FALSE;
+  *pulse = GST_READ_UINT32_LE (inbytes + 1);
+  gst_cswdec_consume (decoder, 5);
+  return TRUE;
+}
+
+static void
+gst_cswdec_init (GstCswDec * decoder)
+{
+  decoder->in = g_byte_array_new ();
+  decoder->out = g_byte_array_new ();
+}
+
+static void
+gst_cswdec_type_find (GstTypeFind * tf, gpointer user_data)
+{
+  const guint8 *data = gst_type_find_peek (tf, 0, strlen (csw_signature));
+
+  if (data != NULL && memcmp (data, csw_signature, strlen (csw_signature)) == 0)
+    gst_type_find_suggest_simple (tf, GST_TYPE_FIND_MAXIMUM,
+        "audio/x-tap-csw", NULL);
+}
+
+gboolean
+gst_cswdec_register (GstPlugin * plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (gst_cswdec_debug, "cswdec",
+      0, "CSW file decoder");
+
+  return gst_type_find_register (plugin, "audio/x-tap-csw", GST_RANK_PRIMARY,
+      gst_cswdec_type_find, "csw", NULL, NULL, NULL)
+      && gst_element_register (plugin, "cswdec", GST_RANK_MARGINAL,
+      GST_TYPE_CSWDEC);
+}
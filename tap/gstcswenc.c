@@ -0,0 +1,737 @@
+/*
+ * GStreamer
+ * Copyright (C) 2011 Fabrizio Gennari <fabrizio.ge@tiscali.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * SECTION:element-cswenc
+ *
+ * Dumps a Commodore TAP stream into the CSW (Compressed Square Wave) file
+ * format. Version 2 files can be compressed with zlib (Z-RLE), which is
+ * done as the data arrives: the long runs of equal pulses of pilot tones
+ * compress very well, and the pulses are kept exactly.
+ *
+ * CSW stores half waves: full waves are split in two halves, the longer
+ * one first. No half wave can be 0: a full wave of one sample becomes two
+ * half waves of one sample, and the sample added is taken back from a later
+ * wave. The number of pulses is in the version 2 header, so the header is
+ * written again at EOS, which requires downstream to seek. If downstream
+ * says it cannot seek, the data is kept in a temporary file, and all is
+ * pushed at EOS, header first. Version 1 files can only have rates up to
+ * 65535.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 filesrc location=tape.wav ! wavparse ! audioconvert ! tapenc halfwaves=true ! cswenc ! filesink location=tape.csw
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+#include <stdio.h>
+#include <glib/gstdio.h>
+#include <zlib.h>
+
+#include "gstcswenc.h"
+
+/* #defines don't like whitespacey bits */
+#define GST_TYPE_CSWENC \
+  (gst_cswenc_get_type())
+#define GST_CSWENC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_CSWENC,GstCswEnc))
+#define GST_CSWENC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_CSWENC,GstCswEncClass))
+#define GST_IS_CSWENC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_CSWENC))
+#define GST_IS_CSWENC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_CSWENC))
+
+typedef struct _GstCswEnc GstCswEnc;
+typedef struct _GstCswEncClass GstCswEncClass;
+
+struct _GstCswEnc
+{
+  GstElement element;
+
+  GstPad *sinkpad, *srcpad;
+
+  guint version;
+  gboolean compress;
+  gint compression_level;
+
+  gint rate;
+  gboolean halfwaves;
+  gboolean sent_header;
+  guint32 pulses;
+  /* samples added to full waves too short to split, to be taken back */
+  guint extra;
+  z_stream zstream;
+  gboolean zstream_initialized;
+  GByteArray *rle;
+  /* if downstream cannot seek, the data after the version 2 header */
+  FILE *spool;
+  gchar *spool_path;
+};
+
+struct _GstCswEncClass
+{
+  GstElementClass parent_class;
+};
+
+GST_DEBUG_CATEGORY_STATIC (gst_cswenc_debug);
+#define GST_CAT_DEFAULT gst_cswenc_debug
+
+enum
+{
+  PROP_0,
+  PROP_VERSION,
+  PROP_COMPRESS,
+  PROP_COMPRESSION_LEVEL
+};
+
+#define CSWENC_V1_HEADER_SIZE 32
+#define CSWENC_V2_HEADER_SIZE 52
+#define CSW_COMPRESSION_RLE 1
+#define CSW_COMPRESSION_Z_RLE 2
+#define CSWENC_DEFLATE_SIZE 16384
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap, "
+        "rate = (int) [ 1, MAX ], " "halfwaves = (boolean) { false, true }")
+    );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap-csw")
+    );
+
+G_DEFINE_TYPE (GstCswEnc, gst_cswenc, GST_TYPE_ELEMENT);
+
+static GstStateChangeReturn gst_cswenc_change_state (GstElement * element,
+    GstStateChange transition);
+
+/* GObject vmethod implementations */
+
+static void
+gst_cswenc_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstCswEnc *filter = GST_CSWENC (object);
+
+  switch (prop_id) {
+    case PROP_VERSION:
+      filter->version = g_value_get_uint (value);
+      break;
+    case PROP_COMPRESS:
+      filter->compress = g_value_get_boolean (value);
+      break;
+    case PROP_COMPRESSION_LEVEL:
+      filter->compression_level = g_value_get_int (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_cswenc_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstCswEnc *filter = GST_CSWENC (object);
+
+  switch (prop_id) {
+    case PROP_VERSION:
+      g_value_set_uint (value, filter->version);
+      break;
+    case PROP_COMPRESS:
+      g_value_set_boolean (value, filter->compress);
+      break;
+    case PROP_COMPRESSION_LEVEL:
+      g_value_set_int (value, filter->compression_level);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_cswenc_close_spool (GstCswEnc * filter)
+{
+  if (filter->spool != NULL) {
+    fclose (filter->spool);
+    filter->spool = NULL;
+  }
+  if (filter->spool_path != NULL) {
+    g_unlink (filter->spool_path);
+    g_free (filter->spool_path);
+    filter->spool_path = NULL;
+  }
+}
+
+static void
+gst_cswenc_reset (GstCswEnc * filter)
+{
+  if (filter->zstream_initialized) {
+    deflateEnd (&filter->zstream);
+    filter->zstream_initialized = FALSE;
+  }
+  filter->sent_header = FALSE;
+  filter->pulses = 0;
+  filter->extra = 0;
+  g_byte_array_set_size (filter->rle, 0);
+  gst_cswenc_close_spool (filter);
+}
+
+static void
+gst_cswenc_finalize (GObject * object)
+{
+  GstCswEnc *filter = GST_CSWENC (object);
+
+  gst_cswenc_reset (filter);
+  g_byte_array_free (filter->rle, TRUE);
+
+  G_OBJECT_CLASS (gst_cswenc_parent_class)->finalize (object);
+}
+
+/* initialize the cswenc's class */
+static void
+gst_cswenc_class_init (GstCswEncClass * klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+  gobject_class = (GObjectClass *) klass;
+
+  gobject_class->set_property = gst_cswenc_set_property;
+  gobject_class->get_property = gst_cswenc_get_property;
+  gobject_class->finalize = gst_cswenc_finalize;
+  element_class->change_state = GST_DEBUG_FUNCPTR (gst_cswenc_change_state);
+
+  g_object_class_install_property (gobject_class, PROP_VERSION,
+      g_param_spec_uint ("version", "Version",
+          "Version of the CSW file, 1 or 2", 1, 2, 2,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_COMPRESS,
+      g_param_spec_boolean ("compress", "Compress",
+          "If true, and version is 2, compress the data with zlib (Z-RLE)",
+          TRUE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_COMPRESSION_LEVEL,
+      g_param_spec_int ("compression-level", "Compression level",
+          "zlib compression level, from 1 (fastest) to 9 (smallest)",
+          1, 9, Z_BEST_COMPRESSION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+
+  gst_element_class_set_details_simple (element_class,
+      "CSW (Compressed Square Wave) file writer",
+      "Codec/Encoder/Audio",
+      "Writes TAP data as CSW files",
+      "Fabrizio Gennari <fabrizio.ge@tiscali.it>");
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_factory));
+}
+
+/* GstElement vmethod implementations */
+
+static gboolean
+gst_cswenc_is_compressed (GstCswEnc * filter)
+{
+  return filter->version >= 2 && filter->compress;
+}
+
+static GstFlowReturn
+gst_cswenc_write_header (GstCswEnc * filter)
+{
+  gsize size = filter->version == 1 ?
+      CSWENC_V1_HEADER_SIZE : CSWENC_V2_HEADER_SIZE;
+  GstBuffer *buf = gst_buffer_new_and_alloc (size);
+  guint8 *header;
+  const char signature[] = "Compressed Square Wave\x1a";
+  const char application[] = "gst-tap";
+  GstMapInfo map;
+
+  gst_buffer_map (buf, &map, GST_MAP_WRITE);
+  header = map.data;
+  memset (header, 0, size);
+  memcpy (header, signature, strlen (signature));
+  header += strlen (signature);
+  *header++ = filter->version;
+  *header++ = filter->version == 1 ? 1 : 0;
+  if (filter->version == 1) {
+    GST_WRITE_UINT16_LE (header, filter->rate);
+    header += 2;
+    *header++ = CSW_COMPRESSION_RLE;
+    /* flags, and 3 reserved bytes, are 0 */
+  } else {
+    GST_WRITE_UINT32_LE (header, filter->rate);
+    header += 4;
+    GST_WRITE_UINT32_LE (header, filter->pulses);
+    header += 4;
+    *header++ = gst_cswenc_is_compressed (filter) ?
+        CSW_COMPRESSION_Z_RLE : CSW_COMPRESSION_RLE;
+    header++;                   /* flags */
+    header++;                   /* no header extension */
+    memcpy (header, application, strlen (application));
+  }
+  gst_buffer_unmap (buf, &map);
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+/* Output to sinks which cannot seek */
+
+static gboolean
+gst_cswenc_downstream_is_seekable (GstCswEnc * filter)
+{
+  GstQuery *query = gst_query_new_seeking (GST_FORMAT_BYTES);
+  gboolean seekable = TRUE;
+
+  /* if downstream does not answer, assume it can seek */
+  if (gst_pad_peer_query (filter->srcpad, query))
+    gst_query_parse_seeking (query, NULL, &seekable, NULL, NULL);
+  gst_query_unref (query);
+
+  return seekable;
+}
+
+static gboolean
+gst_cswenc_open_spool (GstCswEnc * filter)
+{
+  GError *error = NULL;
+  gint fd = g_file_open_tmp ("gstcswenc-XXXXXX", &filter->spool_path,
+      &error);
+
+  if (fd < 0) {
+    GST_ELEMENT_ERROR (filter, RESOURCE, OPEN_WRITE, (NULL),
+        ("cannot create temporary file: %s", error->message));
+    g_error_free (error);
+    return FALSE;
+  }
+  filter->spool = fdopen (fd, "wb");
+  if (filter->spool == NULL) {
+    g_close (fd, NULL);
+    GST_ELEMENT_ERROR (filter, RESOURCE, OPEN_WRITE, (NULL),
+        ("cannot open temporary file %s", filter->spool_path));
+    gst_cswenc_close_spool (filter);
+    return FALSE;
+  }
+  GST_DEBUG_OBJECT (filter, "downstream cannot seek, keeping output in %s",
+      filter->spool_path);
+  return TRUE;
+}
+
+static GstFlowReturn
+gst_cswenc_output (GstCswEnc * filter, GstBuffer * buf)
+{
+  GstMapInfo map;
+  gboolean written;
+
+  if (filter->spool == NULL)
+    return gst_pad_push (filter->srcpad, buf);
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  written = fwrite (map.data, 1, map.size, filter->spool) == map.size;
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+  if (!written) {
+    GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, (NULL),
+        ("cannot write to temporary file %s", filter->spool_path));
+    return GST_FLOW_ERROR;
+  }
+  return GST_FLOW_OK;
+}
+
+/* at EOS, pushes the header and then the whole temporary file, mapped in
+ * memory */
+static GstFlowReturn
+gst_cswenc_flush_spool (GstCswEnc * filter)
+{
+  GstFlowReturn ret;
+  GMappedFile *mapped;
+  GError *error = NULL;
+  gsize size;
+
+  if (fclose (filter->spool) != 0) {
+    filter->spool = NULL;
+    GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, (NULL),
+        ("cannot write to temporary file %s", filter->spool_path));
+    gst_cswenc_close_spool (filter);
+    return GST_FLOW_ERROR;
+  }
+  filter->spool = NULL;
+
+  ret = gst_cswenc_write_header (filter);
+  if (ret == GST_FLOW_OK) {
+    mapped = g_mapped_file_new (filter->spool_path, FALSE, &error);
+    if (mapped == NULL) {
+      GST_ELEMENT_ERROR (filter, RESOURCE, READ, (NULL),
+          ("cannot read temporary file %s: %s", filter->spool_path,
+              error->message));
+      g_error_free (error);
+      ret = GST_FLOW_ERROR;
+    } else if ((size = g_mapped_file_get_length (mapped)) == 0)
+      g_mapped_file_unref (mapped);
+    else
+      ret = gst_pad_push (filter->srcpad,
+          gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+              g_mapped_file_get_contents (mapped), size, 0, size, mapped,
+              (GDestroyNotify) g_mapped_file_unref));
+  }
+  gst_cswenc_close_spool (filter);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_cswenc_start (GstCswEnc * filter)
+{
+  if (gst_cswenc_is_compressed (filter)) {
+    memset (&filter->zstream, 0, sizeof (filter->zstream));
+    if (deflateInit (&filter->zstream, filter->compression_level) != Z_OK) {
+      GST_ELEMENT_ERROR (filter, LIBRARY, INIT, (NULL),
+          ("cannot initialize zlib"));
+      return GST_FLOW_ERROR;
+    }
+    filter->zstream_initialized = TRUE;
+  }
+  filter->sent_header = TRUE;
+
+  /* the number of pulses will be written at EOS, with the header if
+   * downstream cannot seek */
+  if (filter->version >= 2 && !gst_cswenc_downstream_is_seekable (filter))
+    return gst_cswenc_open_spool (filter) ? GST_FLOW_OK : GST_FLOW_ERROR;
+  return gst_cswenc_write_header (filter);
+}
+
+static void
+gst_cswenc_put_pulse (GstCswEnc * filter, guint32 pulse)
+{
+  if (pulse > 0 && pulse < 256) {
+    guint8 byte = pulse;
+
+    g_byte_array_append (filter->rle, &byte, 1);
+  } else {
+    guint8 bytes[5];
+
+    bytes[0] = 0;
+    GST_WRITE_UINT32_LE (bytes + 1, pulse);
+    g_byte_array_append (filter->rle, bytes, 5);
+  }
+  filter->pulses++;
+}
+
+/* CSW has levels: a full wave is split in two, the longer half first. A
+ * half wave of 0 would be no level at all, so a wave too short to split
+ * gets a sample more, taken back from the next wave long enough */
+static void
+gst_cswenc_put_wave (GstCswEnc * filter, guint32 wave)
+{
+  guint32 first, second;
+
+  if (filter->extra > 0 && wave > 2) {
+    wave--;
+    filter->extra--;
+  }
+  first = wave - wave / 2;
+  second = wave / 2;
+  if (first == 0) {
+    first = 1;
+    filter->extra++;
+  }
+  if (second == 0) {
+    second = 1;
+    filter->extra++;
+  }
+  gst_cswenc_put_pulse (filter, first);
+  gst_cswenc_put_pulse (filter, second);
+}
+
+/* compresses the RLE data, if needed, and pushes it */
+static GstFlowReturn
+gst_cswenc_push_rle (GstCswEnc * filter, gboolean finish)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  int zret;
+
+  if (!gst_cswenc_is_compressed (filter)) {
+    guint len = filter->rle->len;
+
+    if (len == 0)
+      return GST_FLOW_OK;
+    ret = gst_cswenc_output (filter,
+        gst_buffer_new_wrapped (g_byte_array_free (filter->rle, FALSE), len));
+    filter->rle = g_byte_array_new ();
+    return ret;
+  }
+
+  filter->zstream.next_in = filter->rle->data;
+  filter->zstream.avail_in = filter->rle->len;
+  do {
+    GstBuffer *buf = gst_buffer_new_allocate (NULL, CSWENC_DEFLATE_SIZE, NULL);
+    GstMapInfo map;
+    gsize size;
+
+    gst_buffer_map (buf, &map, GST_MAP_WRITE);
+    filter->zstream.next_out = map.data;
+    filter->zstream.avail_out = CSWENC_DEFLATE_SIZE;
+    zret = deflate (&filter->zstream, finish ? Z_FINISH : Z_NO_FLUSH);
+    size = CSWENC_DEFLATE_SIZE - filter->zstream.avail_out;
+    gst_buffer_unmap (buf, &map);
+
+    if (zret == Z_STREAM_ERROR) {
+      gst_buffer_unref (buf);
+      GST_ELEMENT_ERROR (filter, STREAM, ENCODE, (NULL),
+          ("cannot compress CSW data"));
+      ret = GST_FLOW_ERROR;
+      break;
+    }
+    if (size > 0) {
+      gst_buffer_set_size (buf, size);
+      ret = gst_cswenc_output (filter, buf);
+    } else
+      gst_buffer_unref (buf);
+    /* without finish, deflate is done when it leaves room in the output */
+  } while (ret == GST_FLOW_OK && (finish ? zret != Z_STREAM_END
+          : filter->zstream.avail_out == 0));
+  g_byte_array_set_size (filter->rle, 0);
+
+  return ret;
+}
+
+/* chain function
+ * this function does the actual processing
+ */
+
+static GstFlowReturn
+gst_cswenc_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  GstCswEnc *filter = GST_CSWENC (parent);
+  GstMapInfo map;
+  const guint32 *data;
+  guint len, i;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  if (filter->rate == 0) {
+    GST_ELEMENT_ERROR (filter, CORE, NEGOTIATION, (NULL),
+        ("no caps before data"));
+    gst_buffer_unref (buf);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  if (!filter->sent_header) {
+    ret = gst_cswenc_start (filter);
+    if (ret != GST_FLOW_OK) {
+      gst_buffer_unref (buf);
+      return ret;
+    }
+  }
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  data = (const guint32 *) map.data;
+  len = map.size / sizeof (guint32);
+  for (i = 0; i < len; i++) {
+    if (filter->halfwaves)
+      gst_cswenc_put_pulse (filter, data[i]);
+    else
+      gst_cswenc_put_wave (filter, data[i]);
+  }
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+
+  return gst_cswenc_push_rle (filter, FALSE);
+}
+
+static gboolean
+gst_cswenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstCswEnc *filter = GST_CSWENC (parent);
+  GstSegment segment;
+  GstStructure *structure;
+  GstCaps *caps;
+  gint rate;
+  gboolean halfwaves;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_EOS:
+      if (!filter->sent_header)
+        break;
+      gst_cswenc_push_rle (filter, TRUE);
+      if (filter->spool != NULL)
+        gst_cswenc_flush_spool (filter);
+      else if (filter->version >= 2) {
+        /* seek to beginning of file, to write the number of pulses */
+        gst_segment_init (&segment, GST_FORMAT_BYTES);
+        if (gst_pad_push_event (filter->srcpad,
+                gst_event_new_segment (&segment)))
+          gst_cswenc_write_header (filter);
+        else
+          GST_ELEMENT_WARNING (filter, STREAM, ENCODE, (NULL),
+              ("downstream cannot seek: the number of pulses in the header is wrong"));
+      }
+      break;
+    case GST_EVENT_CAPS:
+      gst_event_parse_caps (event, &caps);
+      structure = gst_caps_get_structure (caps, 0);
+      if (!gst_structure_get_int (structure, "rate", &rate)
+          || !gst_structure_get_boolean (structure, "halfwaves", &halfwaves)) {
+        GST_ERROR_OBJECT (filter, "input caps have no rate or halfwaves");
+        gst_event_unref (event);
+        return FALSE;
+      }
+      if (filter->version == 1 && rate > G_MAXUINT16) {
+        GST_ELEMENT_ERROR (filter, CORE, NEGOTIATION, (NULL),
+            ("rate %d is too high for a version 1 CSW file", rate));
+        gst_event_unref (event);
+        return FALSE;
+      }
+      if (filter->sent_header && rate != filter->rate) {
+        GST_ERROR_OBJECT (filter, "cannot change rate after the header");
+        gst_event_unref (event);
+        return FALSE;
+      }
+      filter->rate = rate;
+      filter->halfwaves = halfwaves;
+      gst_event_unref (event);
+
+      return gst_pad_push_event (filter->srcpad,
+          gst_event_new_caps (gst_static_pad_template_get_caps
+              (&src_factory)));
+    default:
+      break;
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static gboolean
+gst_cswenc_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  gboolean res;
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CAPS:
+    {
+      GstCswEnc *filter = GST_CSWENC (parent);
+      GstCaps *ret = gst_caps_copy (gst_pad_get_pad_template_caps (pad));
+
+      if (filter->version == 1)
+        gst_caps_set_simple (ret, "rate", GST_TYPE_INT_RANGE, 1, G_MAXUINT16,
+            NULL);
+      gst_query_set_caps_result (query, ret);
+      gst_caps_unref (ret);
+      res = TRUE;
+
+      break;
+    }
+    default:
+      res = gst_pad_query_default (pad, parent, query);
+      break;
+  }
+  return res;
+}
+
+static GstStateChangeReturn
+gst_cswenc_change_state (GstElement * element, GstStateChange transition)
+{
+  GstCswEnc *filter = GST_CSWENC (element);
+  GstStateChangeReturn ret =
+      GST_ELEMENT_CLASS (gst_cswenc_parent_class)->change_state (element,
+      transition);
+
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY) {
+    gst_cswenc_reset (filter);
+    filter->rate = 0;
+  }
+
+  return ret;
+}
+
+/* initialize the new element
+ * instantiate pads and add them to element
+ * set pad calback functions
+ * initialize instance structure
+ */
+
+static void
+gst_cswenc_init (GstCswEnc * filter)
+{
+  filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_chain_function (filter->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_cswenc_chain));
+  gst_pad_set_event_function (filter->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_cswenc_sink_event));
+  gst_pad_set_query_function (filter->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_cswenc_query));
+  filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
+  gst_pad_use_fixed_caps (filter->srcpad);
+
+  gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+  filter->rle = g_byte_array_new ();
+}
+
+gboolean
+gst_cswenc_register (GstPlugin * plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (gst_cswenc_debug, "cswenc",
+      0, "CSW file encoder");
+
+  return gst_element_register (plugin, "cswenc", GST_RANK_NONE,
+      GST_TYPE_CSWENC);
+}
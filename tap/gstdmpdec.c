@@ -158,7 +158,8 @@ gst_dmpdec_read_header (GstBaseTapContainerDec * filter,
   header_data ++;           /* skip the useless byte in header */
   bits_per_sample = *header_data++;
   decoder->bytes_per_sample = (bits_per_sample + 7) / 8;
-  decoder->overflow = (1 << bits_per_sample) - 1;
+  decoder->overflow =
+      bits_per_sample >= 32 ? G_MAXUINT32 : (1U << bits_per_sample) - 1;
   filter->rate = GST_READ_UINT32_LE (header_data);
 
   if (!header_valid)
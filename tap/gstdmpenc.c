@@ -0,0 +1,528 @@
+/*
+ * GStreamer
+ * Copyright (C) 2011 Fabrizio Gennari <fabrizio.ge@tiscali.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/**
+ * SECTION:element-dmpenc
+ *
+ * Dumps a Commodore TAP stream into the DMP file format, the one created by
+ * DC2N devices. Unlike the TAP file format, DMP has no fixed clock, so the
+ * pulses are stored at the rate they come with, without losing precision.
+ *
+ * Each pulse is stored in bits-per-sample bits. A pulse too long for them is
+ * stored as a chain of samples with all bits set, followed by the rest. With
+ * bits-per-sample=0, the size is chosen as the one giving the smallest file
+ * for the first pulses: those are held back until the choice is made. The
+ * header has no length in it, so it is never written again, and the output
+ * can go to a sink which cannot seek.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 filesrc location=tape.wav ! wavparse ! audioconvert ! tapenc ! dmpenc ! filesink location=tape.dmp
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+
+#include "gstdmpenc.h"
+
+/* #defines don't like whitespacey bits */
+#define GST_TYPE_DMPENC \
+  (gst_dmpenc_get_type())
+#define GST_DMPENC(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_DMPENC,GstDmpEnc))
+#define GST_DMPENC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_DMPENC,GstDmpEncClass))
+#define GST_IS_DMPENC(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_DMPENC))
+#define GST_IS_DMPENC_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_DMPENC))
+
+typedef struct _GstDmpEnc GstDmpEnc;
+typedef struct _GstDmpEncClass GstDmpEncClass;
+
+struct _GstDmpEnc
+{
+  GstElement element;
+
+  GstPad *sinkpad, *srcpad;
+
+  guint bits_per_sample;
+  guint auto_prefix;
+
+  gint rate;
+  gboolean halfwaves;
+  gboolean sent_header;
+  /* bytes per sample and overflow value of the header sent */
+  guchar width;
+  guint32 overflow;
+  /* pulses held back while choosing bits-per-sample */
+  GArray *prefix;
+};
+
+struct _GstDmpEncClass
+{
+  GstElementClass parent_class;
+};
+
+GST_DEBUG_CATEGORY_STATIC (gst_dmpenc_debug);
+#define GST_CAT_DEFAULT gst_dmpenc_debug
+
+enum
+{
+  PROP_0,
+  PROP_BITS_PER_SAMPLE,
+  PROP_AUTO_PREFIX
+};
+
+#define DMPENC_HEADER_SIZE 20
+#define DMPENC_VERSION 1
+#define DMPENC_DEFAULT_AUTO_PREFIX 65536
+
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap, "
+        "rate = (int) [ 1, MAX ], " "halfwaves = (boolean) { false, true }")
+    );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap-dmp")
+    );
+
+G_DEFINE_TYPE (GstDmpEnc, gst_dmpenc, GST_TYPE_ELEMENT);
+
+static GstStateChangeReturn gst_dmpenc_change_state (GstElement * element,
+    GstStateChange transition);
+
+/* GObject vmethod implementations */
+
+static void
+gst_dmpenc_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstDmpEnc *filter = GST_DMPENC (object);
+
+  switch (prop_id) {
+    case PROP_BITS_PER_SAMPLE:
+      filter->bits_per_sample = g_value_get_uint (value);
+      break;
+    case PROP_AUTO_PREFIX:
+      filter->auto_prefix = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_dmpenc_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstDmpEnc *filter = GST_DMPENC (object);
+
+  switch (prop_id) {
+    case PROP_BITS_PER_SAMPLE:
+      g_value_set_uint (value, filter->bits_per_sample);
+      break;
+    case PROP_AUTO_PREFIX:
+      g_value_set_uint (value, filter->auto_prefix);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_dmpenc_finalize (GObject * object)
+{
+  GstDmpEnc *filter = GST_DMPENC (object);
+
+  g_array_free (filter->prefix, TRUE);
+
+  G_OBJECT_CLASS (gst_dmpenc_parent_class)->finalize (object);
+}
+
+/* initialize the dmpenc's class */
+static void
+gst_dmpenc_class_init (GstDmpEncClass * klass)
+{
+  GObjectClass *gobject_class;
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+  gobject_class = (GObjectClass *) klass;
+
+  gobject_class->set_property = gst_dmpenc_set_property;
+  gobject_class->get_property = gst_dmpenc_get_property;
+  gobject_class->finalize = gst_dmpenc_finalize;
+  element_class->change_state = GST_DEBUG_FUNCPTR (gst_dmpenc_change_state);
+
+  g_object_class_install_property (gobject_class, PROP_BITS_PER_SAMPLE,
+      g_param_spec_uint ("bits-per-sample", "Bits per sample",
+          "Size of a sample in the file: 8, 16, 24 or 32, other values are rounded up. 0 = the one giving the smallest file for the first auto-prefix pulses",
+          0, 32, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_AUTO_PREFIX,
+      g_param_spec_uint ("auto-prefix", "Auto prefix",
+          "Number of pulses held back to choose bits-per-sample, when it is 0",
+          1, G_MAXUINT, DMPENC_DEFAULT_AUTO_PREFIX,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+
+  gst_element_class_set_details_simple (element_class,
+      "Commodore DMP (format generated by DC2N devices) file writer",
+      "Codec/Encoder/Audio",
+      "Writes TAP data as DMP files",
+      "Fabrizio Gennari <fabrizio.ge@tiscali.it>");
+
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&src_factory));
+  gst_element_class_add_pad_template (element_class,
+      gst_static_pad_template_get (&sink_factory));
+}
+
+/* GstElement vmethod implementations */
+
+static void
+gst_dmpenc_set_width (GstDmpEnc * filter, guint width)
+{
+  filter->width = width;
+  filter->overflow = width == 4 ? G_MAXUINT32 : (1U << (8 * width)) - 1;
+}
+
+/* size of the pulses when stored in samples of the given width */
+static guint64
+gst_dmpenc_packed_size (const guint32 * data, guint len, guint width)
+{
+  guint32 overflow = width == 4 ? G_MAXUINT32 : (1U << (8 * width)) - 1;
+  guint64 samples = len;
+  guint i;
+
+  for (i = 0; i < len; i++)
+    samples += data[i] / overflow;
+
+  return samples * width;
+}
+
+/* chooses the width which gives the smallest output for the pulses held
+ * back; on a tie, the narrower one */
+static void
+gst_dmpenc_choose_width (GstDmpEnc * filter)
+{
+  const guint32 *data = (const guint32 *) filter->prefix->data;
+  guint len = filter->prefix->len;
+  guint64 best_size = G_MAXUINT64;
+  guint width, best_width = 1;
+
+  for (width = 1; width <= 4; width++) {
+    guint64 size = gst_dmpenc_packed_size (data, len, width);
+
+    GST_DEBUG_OBJECT (filter, "%u bits per sample: %" G_GUINT64_FORMAT
+        " bytes", 8 * width, size);
+    if (size < best_size) {
+      best_size = size;
+      best_width = width;
+    }
+  }
+  gst_dmpenc_set_width (filter, best_width);
+}
+
+/* Packing: one loop for each width, so that the store is not chosen at
+ * each pulse. Pulses up to overflow - 1 are a single sample, longer ones
+ * are a chain of overflow samples, followed by the rest, which may be 0 */
+
+#define DMPENC_PACK_LOOP(write) \
+  for (i = 0; i < len; i++) { \
+    guint32 pulse = data[i]; \
+    while (pulse >= overflow) { \
+      write (out, overflow); \
+      out += width; \
+      pulse -= overflow; \
+    } \
+    write (out, pulse); \
+    out += width; \
+  }
+
+#define DMPENC_WRITE_UINT8(out, val) (*(out) = (guint8) (val))
+
+static void
+gst_dmpenc_pack (GstDmpEnc * filter, const guint32 * data, guint len,
+    guint8 * out)
+{
+  const guint32 overflow = filter->overflow;
+  const guint width = filter->width;
+  guint i;
+
+  switch (width) {
+    case 1:
+      DMPENC_PACK_LOOP (DMPENC_WRITE_UINT8);
+      break;
+    case 2:
+      DMPENC_PACK_LOOP (GST_WRITE_UINT16_LE);
+      break;
+    case 3:
+      DMPENC_PACK_LOOP (GST_WRITE_UINT24_LE);
+      break;
+    case 4:
+    default:
+      DMPENC_PACK_LOOP (GST_WRITE_UINT32_LE);
+      break;
+  }
+}
+
+static GstFlowReturn
+gst_dmpenc_write_header (GstDmpEnc * filter)
+{
+  GstBuffer *buf = gst_buffer_new_and_alloc (DMPENC_HEADER_SIZE);
+  guint8 *header;
+  const char signature[] = "DC2N-TAP-RAW";
+  GstMapInfo map;
+
+  GST_DEBUG_OBJECT (filter, "writing header: rate %d, %u bits per sample",
+      filter->rate, 8 * filter->width);
+  gst_buffer_map (buf, &map, GST_MAP_WRITE);
+  header = map.data;
+  memcpy (header, signature, strlen (signature));
+  header += strlen (signature);
+  *header++ = DMPENC_VERSION;
+  *header++ = filter->halfwaves ? 1 << 4 : 0;
+  *header++ = 0;
+  *header++ = 8 * filter->width;
+  GST_WRITE_UINT32_LE (header, filter->rate);
+  gst_buffer_unmap (buf, &map);
+  filter->sent_header = TRUE;
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+static GstFlowReturn
+gst_dmpenc_push_pulses (GstDmpEnc * filter, const guint32 * data, guint len)
+{
+  guint64 size = gst_dmpenc_packed_size (data, len, filter->width);
+  GstBuffer *buf;
+  GstMapInfo map;
+
+  if (size == 0)
+    return GST_FLOW_OK;
+
+  buf = gst_buffer_new_allocate (NULL, size, NULL);
+  gst_buffer_map (buf, &map, GST_MAP_WRITE);
+  gst_dmpenc_pack (filter, data, len, map.data);
+  gst_buffer_unmap (buf, &map);
+
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+/* chooses the width, if not done yet, and sends the header and the pulses
+ * held back */
+static GstFlowReturn
+gst_dmpenc_start (GstDmpEnc * filter)
+{
+  GstFlowReturn ret;
+
+  if (filter->bits_per_sample == 0)
+    gst_dmpenc_choose_width (filter);
+  else
+    gst_dmpenc_set_width (filter, (filter->bits_per_sample + 7) / 8);
+
+  ret = gst_dmpenc_write_header (filter);
+  if (ret == GST_FLOW_OK)
+    ret = gst_dmpenc_push_pulses (filter,
+        (const guint32 *) filter->prefix->data, filter->prefix->len);
+  g_array_set_size (filter->prefix, 0);
+
+  return ret;
+}
+
+/* chain function
+ * this function does the actual processing
+ */
+
+static GstFlowReturn
+gst_dmpenc_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  GstDmpEnc *filter = GST_DMPENC (parent);
+  GstMapInfo map;
+  const guint32 *data;
+  guint len;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  if (filter->rate == 0) {
+    GST_ELEMENT_ERROR (filter, CORE, NEGOTIATION, (NULL),
+        ("no caps before data"));
+    gst_buffer_unref (buf);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  data = (const guint32 *) map.data;
+  len = map.size / sizeof (guint32);
+
+  if (!filter->sent_header && filter->bits_per_sample == 0) {
+    guint take = MIN (len, filter->auto_prefix - filter->prefix->len);
+
+    g_array_append_vals (filter->prefix, data, take);
+    data += take;
+    len -= take;
+    if (filter->prefix->len >= filter->auto_prefix)
+      ret = gst_dmpenc_start (filter);
+  } else if (!filter->sent_header)
+    ret = gst_dmpenc_start (filter);
+
+  if (ret == GST_FLOW_OK && filter->sent_header)
+    ret = gst_dmpenc_push_pulses (filter, data, len);
+
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+
+  return ret;
+}
+
+static gboolean
+gst_dmpenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstDmpEnc *filter = GST_DMPENC (parent);
+  GstStructure *structure;
+  GstCaps *caps;
+  gint rate;
+  gboolean halfwaves;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_EOS:
+      /* a stream shorter than auto-prefix */
+      if (!filter->sent_header && filter->rate != 0)
+        gst_dmpenc_start (filter);
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      if (!filter->sent_header)
+        g_array_set_size (filter->prefix, 0);
+      break;
+    case GST_EVENT_CAPS:
+      gst_event_parse_caps (event, &caps);
+      structure = gst_caps_get_structure (caps, 0);
+      if (!gst_structure_get_int (structure, "rate", &rate)
+          || !gst_structure_get_boolean (structure, "halfwaves", &halfwaves)) {
+        GST_ERROR_OBJECT (filter, "input caps have no rate or halfwaves");
+        gst_event_unref (event);
+        return FALSE;
+      }
+      if (filter->sent_header && (rate != filter->rate
+              || halfwaves != filter->halfwaves)) {
+        GST_ERROR_OBJECT (filter, "cannot change format after the header");
+        gst_event_unref (event);
+        return FALSE;
+      }
+      filter->rate = rate;
+      filter->halfwaves = halfwaves;
+      gst_event_unref (event);
+
+      return gst_pad_push_event (filter->srcpad,
+          gst_event_new_caps (gst_static_pad_template_get_caps
+              (&src_factory)));
+    default:
+      break;
+  }
+
+  return gst_pad_event_default (pad, parent, event);
+}
+
+static GstStateChangeReturn
+gst_dmpenc_change_state (GstElement * element, GstStateChange transition)
+{
+  GstDmpEnc *filter = GST_DMPENC (element);
+  GstStateChangeReturn ret =
+      GST_ELEMENT_CLASS (gst_dmpenc_parent_class)->change_state (element,
+      transition);
+
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY) {
+    filter->sent_header = FALSE;
+    filter->rate = 0;
+    g_array_set_size (filter->prefix, 0);
+  }
+
+  return ret;
+}
+
+/* initialize the new element
+ * instantiate pads and add them to element
+ * set pad calback functions
+ * initialize instance structure
+ */
+
+static void
+gst_dmpenc_init (GstDmpEnc * filter)
+{
+  filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  gst_pad_set_chain_function (filter->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_dmpenc_chain));
+  gst_pad_set_event_function (filter->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_dmpenc_sink_event));
+  filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
+  gst_pad_use_fixed_caps (filter->srcpad);
+
+  gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
+  gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
+  filter->prefix = g_array_new (FALSE, FALSE, sizeof (guint32));
+}
+
+gboolean
+gst_dmpenc_register (GstPlugin * plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (gst_dmpenc_debug, "dmpenc",
+      0, "Commodore 64 DMP encoder");
+
+  return gst_element_register (plugin, "dmpenc", GST_RANK_NONE,
+      GST_TYPE_DMPENC);
+}
@@ -0,0 +1,736 @@
+/*
+ * GStreamer
+ * Copyright (C) 2011 Fabrizio Gennari <fabrizio.ge@tiscali.it>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:element-tapconsensus
+ *
+ * Merge several captures of the same tape, in the Commodore TAP format,
+ * into one.
+ *
+ * All inputs are collected until EOS. Each input is aligned to the first
+ * one (sink_0) window by window, looking for the shift that makes most
+ * pulses match, so that pulses lost or added by dropouts do not put the
+ * rest out of step. Then each pulse of the output is the median, or the
+ * value most inputs agree with, of the corresponding pulses. At the end,
+ * a tapconsensus-report element message tells how many pulses were not
+ * agreed upon by all inputs, in total and for each input.
+ *
+ * All inputs must have the same rate and halfwaves: use tapconvert if they
+ * do not.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 tapconsensus name=c ! tapfileenc ! filesink location=merged.tap filesrc location=a.tap ! tapfiledec ! c. filesrc location=b.tap ! tapfiledec ! c. filesrc location=c.tap ! tapfiledec ! c.
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/base/gstaggregator.h>
+
+#include "gsttapconsensus.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_tapconsensus_debug);
+#define GST_CAT_DEFAULT gst_tapconsensus_debug
+
+#define GST_TYPE_TAP_CONSENSUS \
+  (gst_tapconsensus_get_type())
+#define GST_TAP_CONSENSUS(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_TAP_CONSENSUS,GstTapConsensus))
+#define GST_TAP_CONSENSUS_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_TAP_CONSENSUS,GstTapConsensusClass))
+#define GST_IS_TAP_CONSENSUS(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_TAP_CONSENSUS))
+#define GST_IS_TAP_CONSENSUS_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_TAP_CONSENSUS))
+
+typedef struct _GstTapConsensus GstTapConsensus;
+typedef struct _GstTapConsensusClass GstTapConsensusClass;
+typedef struct _GstTapConsensusStream GstTapConsensusStream;
+typedef struct _GstTapConsensusMerge GstTapConsensusMerge;
+typedef struct _GstTapConsensusJob GstTapConsensusJob;
+
+typedef enum
+{
+  TAPCONSENSUS_MEDIAN,
+  TAPCONSENSUS_MAJORITY
+} GstTapConsensusMethod;
+
+struct _GstTapConsensus
+{
+  GstAggregator element;
+
+  guint window;
+  guint search_range;
+  guint tolerance;
+  GstTapConsensusMethod method;
+
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+  guint running;
+};
+
+struct _GstTapConsensusClass
+{
+  GstAggregatorClass parent_class;
+};
+
+/* An input, with the shift which aligns each window of the first input
+ * to it */
+struct _GstTapConsensusStream
+{
+  GArray *pulses;
+  gint64 *shifts;
+  guint64 disagreements;
+};
+
+/* The inputs being merged, and the output */
+struct _GstTapConsensusMerge
+{
+  GPtrArray *streams;
+  guint32 *output;
+  guint64 disagreements;
+};
+
+/* Either aligns a stream to the first one (if stream is not NULL) or votes
+ * on the output pulses from start to end */
+struct _GstTapConsensusJob
+{
+  GstTapConsensusMerge *merge;
+  GstTapConsensusStream *stream;
+  guint64 start, end;
+};
+
+enum
+{
+  PROP_0,
+  PROP_WINDOW,
+  PROP_SEARCH_RANGE,
+  PROP_TOLERANCE,
+  PROP_METHOD
+};
+
+#define TAPCONSENSUS_DEFAULT_WINDOW 256
+#define TAPCONSENSUS_DEFAULT_SEARCH_RANGE 64
+#define TAPCONSENSUS_DEFAULT_TOLERANCE 12
+
+/* when no shift within search-range makes half of a window match, one
+ * this many times wider is tried */
+#define TAPCONSENSUS_WIDE_SEARCH 16
+
+/* number of output pulses voted on by a single job */
+#define TAPCONSENSUS_VOTE_BLOCK 65536
+
+static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("audio/x-tap, rate=(int)[1,2000000], halfwaves=(boolean){false,true}")
+    );
+
+static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap, rate=(int)[1,2000000], halfwaves=(boolean){false,true}")
+    );
+
+G_DEFINE_TYPE (GstTapConsensus, gst_tapconsensus, GST_TYPE_AGGREGATOR);
+
+static GQuark pulses_quark;
+
+static GType
+gst_methods_get_type (void)
+{
+  static GType methods_type = 0;
+
+  if (methods_type == 0) {
+    static const GEnumValue methods_profiles[] = {
+      {TAPCONSENSUS_MEDIAN, "median", "Median of the inputs"},
+      {TAPCONSENSUS_MAJORITY, "majority",
+          "Value most inputs agree with"},
+      {0, NULL, NULL},
+    };
+    methods_type =
+        g_enum_register_static ("GstTapConsensusMethods", methods_profiles);
+  }
+
+  return methods_type;
+}
+
+static GArray *
+gst_tapconsensus_pad_pulses (GstPad * pad)
+{
+  GArray *pulses = g_object_get_qdata (G_OBJECT (pad), pulses_quark);
+
+  if (pulses == NULL) {
+    pulses = g_array_new (FALSE, FALSE, sizeof (guint32));
+    g_object_set_qdata_full (G_OBJECT (pad), pulses_quark, pulses,
+        (GDestroyNotify) g_array_unref);
+  }
+  return pulses;
+}
+
+static gboolean
+gst_tapconsensus_close_enough (guint32 a, guint32 b, guint tolerance)
+{
+  guint64 diff = a > b ? a - b : b - a;
+
+  return diff * 100 <= (guint64) MAX (a, b) * tolerance;
+}
+
+/* how many pulses of ref[start..start+len) match the pulses of other
+ * shifted by shift */
+static guint
+gst_tapconsensus_matches (GstTapConsensus * filter, GArray * ref,
+    guint64 start, guint len, GArray * other, gint64 shift)
+{
+  const guint32 *a = (const guint32 *) ref->data;
+  const guint32 *b = (const guint32 *) other->data;
+  guint i, matches = 0;
+
+  for (i = 0; i < len; i++) {
+    gint64 j = (gint64) (start + i) + shift;
+    if (j >= 0 && j < other->len
+        && gst_tapconsensus_close_enough (a[start + i], b[j],
+            filter->tolerance))
+      matches++;
+  }
+  return matches;
+}
+
+/* best shift in [center - range, center + range], the nearest to center
+ * among equally good ones */
+static gint64
+gst_tapconsensus_best_shift (GstTapConsensus * filter, GArray * ref,
+    guint64 start, guint len, GArray * other, gint64 center, guint range,
+    guint * best_matches)
+{
+  gint64 best = center;
+  guint d;
+
+  *best_matches =
+      gst_tapconsensus_matches (filter, ref, start, len, other, center);
+  for (d = 1; d <= range && *best_matches < len; d++) {
+    guint matches =
+        gst_tapconsensus_matches (filter, ref, start, len, other, center + d);
+    if (matches > *best_matches) {
+      *best_matches = matches;
+      best = center + d;
+    }
+    matches =
+        gst_tapconsensus_matches (filter, ref, start, len, other, center - d);
+    if (matches > *best_matches) {
+      *best_matches = matches;
+      best = center - d;
+    }
+  }
+  return best;
+}
+
+static void
+gst_tapconsensus_align (GstTapConsensus * filter, GArray * ref,
+    GstTapConsensusStream * stream)
+{
+  guint64 windows = (ref->len + filter->window - 1) / filter->window;
+  gint64 shift = 0;
+  guint64 w;
+
+  for (w = 0; w < windows; w++) {
+    guint64 start = w * filter->window;
+    guint len = MIN (filter->window, ref->len - start);
+    guint matches;
+    gint64 best = gst_tapconsensus_best_shift (filter, ref, start, len,
+        stream->pulses, shift, filter->search_range, &matches);
+
+    if (matches * 2 < len) {
+      guint wide_matches;
+      gint64 wide = gst_tapconsensus_best_shift (filter, ref, start, len,
+          stream->pulses, shift,
+          filter->search_range * TAPCONSENSUS_WIDE_SEARCH, &wide_matches);
+      if (wide_matches * 2 >= len)
+        best = wide;
+      else if (matches * 4 < len)
+        /* probably a dropout: keep the previous alignment */
+        best = shift;
+    }
+    stream->shifts[w] = shift = best;
+  }
+}
+
+static int
+gst_tapconsensus_compare (gconstpointer a, gconstpointer b)
+{
+  guint32 x = *(const guint32 *) a, y = *(const guint32 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static guint32
+gst_tapconsensus_pick (GstTapConsensus * filter, guint32 * values, guint n)
+{
+  guint i, j, best_votes = 0;
+  guint32 best;
+
+  qsort (values, n, sizeof (guint32), gst_tapconsensus_compare);
+  best = values[n / 2];
+  if (filter->method == TAPCONSENSUS_MEDIAN)
+    return best;
+
+  for (i = 0; i < n; i++) {
+    guint votes = 0;
+    for (j = 0; j < n; j++)
+      if (gst_tapconsensus_close_enough (values[i], values[j],
+              filter->tolerance))
+        votes++;
+    if (votes > best_votes) {
+      best_votes = votes;
+      best = values[i];
+    }
+  }
+  return best;
+}
+
+static void
+gst_tapconsensus_vote (GstTapConsensus * filter, GstTapConsensusMerge * merge,
+    guint64 start, guint64 end)
+{
+  GPtrArray *streams = merge->streams;
+  guint32 *values = g_new (guint32, streams->len);
+  guint32 *sorted = g_new (guint32, streams->len);
+  guint *value_stream = g_new (guint, streams->len);
+  guint64 *disagreements = g_new0 (guint64, streams->len);
+  guint64 total = 0;
+  guint64 i;
+  guint k;
+
+  for (i = start; i < end; i++) {
+    gboolean agreed = TRUE;
+    guint n = 0;
+    guint32 picked;
+
+    for (k = 0; k < streams->len; k++) {
+      GstTapConsensusStream *stream = g_ptr_array_index (streams, k);
+      gint64 j = k == 0 ? (gint64) i : (gint64) i +
+          stream->shifts[i / filter->window];
+
+      if (j >= 0 && j < stream->pulses->len) {
+        values[n] = g_array_index (stream->pulses, guint32, j);
+        value_stream[n++] = k;
+      }
+    }
+    memcpy (sorted, values, n * sizeof (guint32));
+    picked = gst_tapconsensus_pick (filter, sorted, n);
+    for (k = 0; k < n; k++)
+      if (!gst_tapconsensus_close_enough (values[k], picked,
+              filter->tolerance)) {
+        disagreements[value_stream[k]]++;
+        agreed = FALSE;
+      }
+    if (!agreed)
+      total++;
+    merge->output[i] = picked;
+  }
+
+  g_mutex_lock (&filter->mutex);
+  for (k = 0; k < streams->len; k++) {
+    GstTapConsensusStream *stream = g_ptr_array_index (streams, k);
+    stream->disagreements += disagreements[k];
+  }
+  merge->disagreements += total;
+  g_mutex_unlock (&filter->mutex);
+
+  g_free (disagreements);
+  g_free (value_stream);
+  g_free (sorted);
+  g_free (values);
+}
+
+/* runs in the thread pool */
+static void
+gst_tapconsensus_run_job (gpointer data, gpointer user_data)
+{
+  GstTapConsensusJob *job = data;
+  GstTapConsensus *filter = user_data;
+
+  if (job->stream != NULL) {
+    GstTapConsensusStream *ref = g_ptr_array_index (job->merge->streams, 0);
+    gst_tapconsensus_align (filter, ref->pulses, job->stream);
+  } else
+    gst_tapconsensus_vote (filter, job->merge, job->start, job->end);
+  g_slice_free (GstTapConsensusJob, job);
+
+  g_mutex_lock (&filter->mutex);
+  filter->running--;
+  g_cond_broadcast (&filter->cond);
+  g_mutex_unlock (&filter->mutex);
+}
+
+static void
+gst_tapconsensus_push_job (GstTapConsensus * filter,
+    GstTapConsensusMerge * merge, GstTapConsensusStream * stream,
+    guint64 start, guint64 end)
+{
+  GstTapConsensusJob *job = g_slice_new (GstTapConsensusJob);
+
+  job->merge = merge;
+  job->stream = stream;
+  job->start = start;
+  job->end = end;
+  g_mutex_lock (&filter->mutex);
+  filter->running++;
+  g_mutex_unlock (&filter->mutex);
+  g_thread_pool_push (filter->pool, job, NULL);
+}
+
+static void
+gst_tapconsensus_wait_jobs (GstTapConsensus * filter)
+{
+  g_mutex_lock (&filter->mutex);
+  while (filter->running > 0)
+    g_cond_wait (&filter->cond, &filter->mutex);
+  g_mutex_unlock (&filter->mutex);
+}
+
+static void
+gst_tapconsensus_free_stream (GstTapConsensusStream * stream)
+{
+  g_array_unref (stream->pulses);
+  g_free (stream->shifts);
+  g_slice_free (GstTapConsensusStream, stream);
+}
+
+static void
+gst_tapconsensus_post_report (GstTapConsensus * filter,
+    GstTapConsensusMerge * merge, guint64 pulses)
+{
+  GValue array = G_VALUE_INIT;
+  GValue value = G_VALUE_INIT;
+  GstStructure *report;
+  guint k;
+
+  g_value_init (&array, GST_TYPE_ARRAY);
+  g_value_init (&value, G_TYPE_UINT64);
+  for (k = 0; k < merge->streams->len; k++) {
+    GstTapConsensusStream *stream = g_ptr_array_index (merge->streams, k);
+    g_value_set_uint64 (&value, stream->disagreements);
+    gst_value_array_append_value (&array, &value);
+  }
+  g_value_unset (&value);
+
+  report = gst_structure_new ("tapconsensus-report",
+      "pulses", G_TYPE_UINT64, pulses,
+      "disagreements", G_TYPE_UINT64, merge->disagreements, NULL);
+  gst_structure_take_value (report, "input-disagreements", &array);
+  gst_element_post_message (GST_ELEMENT_CAST (filter),
+      gst_message_new_element (GST_OBJECT_CAST (filter), report));
+}
+
+/* all inputs are complete: aligns them, votes, and pushes the result */
+static GstFlowReturn
+gst_tapconsensus_merge (GstTapConsensus * filter)
+{
+  GstAggregator *agg = GST_AGGREGATOR (filter);
+  GstTapConsensusMerge merge = { NULL, NULL, 0 };
+  GstCaps *caps = NULL;
+  GstFlowReturn ret = GST_FLOW_EOS;
+  GstTapConsensusStream *ref;
+  guint64 windows, i;
+  GList *l;
+  guint k;
+
+  merge.streams = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_tapconsensus_free_stream);
+
+  GST_OBJECT_LOCK (filter);
+  for (l = GST_ELEMENT_CAST (filter)->sinkpads; l != NULL; l = l->next) {
+    GstPad *pad = l->data;
+    GstCaps *padcaps = gst_pad_get_current_caps (pad);
+    GstTapConsensusStream *stream;
+
+    if (padcaps == NULL)
+      continue;
+    if (caps == NULL)
+      caps = padcaps;
+    else {
+      gboolean equal = gst_caps_is_equal (caps, padcaps);
+      gst_caps_unref (padcaps);
+      if (!equal) {
+        GST_OBJECT_UNLOCK (filter);
+        GST_ELEMENT_ERROR (filter, STREAM, FORMAT, (NULL),
+            ("all inputs must have the same rate and halfwaves"));
+        ret = GST_FLOW_NOT_NEGOTIATED;
+        goto done;
+      }
+    }
+    stream = g_slice_new0 (GstTapConsensusStream);
+    stream->pulses = g_array_ref (gst_tapconsensus_pad_pulses (pad));
+    g_ptr_array_add (merge.streams, stream);
+  }
+  GST_OBJECT_UNLOCK (filter);
+
+  if (merge.streams->len == 0)
+    goto done;
+
+  ref = g_ptr_array_index (merge.streams, 0);
+  windows = (ref->pulses->len + filter->window - 1) / filter->window;
+  for (k = 1; k < merge.streams->len; k++) {
+    GstTapConsensusStream *stream = g_ptr_array_index (merge.streams, k);
+    stream->shifts = g_new0 (gint64, MAX (windows, 1));
+    gst_tapconsensus_push_job (filter, &merge, stream, 0, 0);
+  }
+  gst_tapconsensus_wait_jobs (filter);
+
+  merge.output = g_new (guint32, MAX (ref->pulses->len, 1));
+  for (i = 0; i < ref->pulses->len; i += TAPCONSENSUS_VOTE_BLOCK)
+    gst_tapconsensus_push_job (filter, &merge, NULL, i,
+        MIN (i + TAPCONSENSUS_VOTE_BLOCK, ref->pulses->len));
+  gst_tapconsensus_wait_jobs (filter);
+
+  GST_DEBUG_OBJECT (filter, "%u inputs, %u pulses, %" G_GUINT64_FORMAT
+      " disagreements", merge.streams->len, ref->pulses->len,
+      merge.disagreements);
+  gst_tapconsensus_post_report (filter, &merge, ref->pulses->len);
+
+  gst_aggregator_set_src_caps (agg, caps);
+  if (ref->pulses->len > 0) {
+    gsize size = ref->pulses->len * sizeof (guint32);
+    ret = gst_aggregator_finish_buffer (agg,
+        gst_buffer_new_wrapped (merge.output, size));
+    merge.output = NULL;
+    if (ret == GST_FLOW_OK)
+      ret = GST_FLOW_EOS;
+  }
+
+done:
+  g_free (merge.output);
+  g_ptr_array_free (merge.streams, TRUE);
+  if (caps)
+    gst_caps_unref (caps);
+  return ret;
+}
+
+static GstFlowReturn
+gst_tapconsensus_aggregate (GstAggregator * agg, gboolean timeout)
+{
+  GstTapConsensus *filter = GST_TAP_CONSENSUS (agg);
+  gboolean all_eos = TRUE;
+  GList *l;
+
+  GST_OBJECT_LOCK (filter);
+  for (l = GST_ELEMENT_CAST (filter)->sinkpads; l != NULL; l = l->next) {
+    GstAggregatorPad *pad = l->data;
+    GArray *pulses = gst_tapconsensus_pad_pulses (GST_PAD (pad));
+    GstBuffer *buf;
+
+    while ((buf = gst_aggregator_pad_pop_buffer (pad)) != NULL) {
+      GstMapInfo map;
+
+      gst_buffer_map (buf, &map, GST_MAP_READ);
+      g_array_append_vals (pulses, map.data, map.size / sizeof (guint32));
+      gst_buffer_unmap (buf, &map);
+      gst_buffer_unref (buf);
+    }
+    if (!gst_aggregator_pad_is_eos (pad))
+      all_eos = FALSE;
+  }
+  GST_OBJECT_UNLOCK (filter);
+
+  if (!all_eos)
+    return GST_FLOW_OK;
+
+  return gst_tapconsensus_merge (filter);
+}
+
+static void
+gst_tapconsensus_clear_pulses (GstTapConsensus * filter)
+{
+  GList *l;
+
+  GST_OBJECT_LOCK (filter);
+  for (l = GST_ELEMENT_CAST (filter)->sinkpads; l != NULL; l = l->next)
+    g_object_set_qdata (G_OBJECT (l->data), pulses_quark, NULL);
+  GST_OBJECT_UNLOCK (filter);
+}
+
+static GstFlowReturn
+gst_tapconsensus_flush (GstAggregator * agg)
+{
+  gst_tapconsensus_clear_pulses (GST_TAP_CONSENSUS (agg));
+  return GST_FLOW_OK;
+}
+
+static gboolean
+gst_tapconsensus_start (GstAggregator * agg)
+{
+  GstTapConsensus *filter = GST_TAP_CONSENSUS (agg);
+
+  filter->pool = g_thread_pool_new (gst_tapconsensus_run_job, filter,
+      g_get_num_processors (), FALSE, NULL);
+  return filter->pool != NULL;
+}
+
+static gboolean
+gst_tapconsensus_stop (GstAggregator * agg)
+{
+  GstTapConsensus *filter = GST_TAP_CONSENSUS (agg);
+
+  g_thread_pool_free (filter->pool, FALSE, TRUE);
+  filter->pool = NULL;
+  gst_tapconsensus_clear_pulses (filter);
+  return TRUE;
+}
+
+static void
+gst_tapconsensus_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstTapConsensus *filter = GST_TAP_CONSENSUS (object);
+
+  switch (prop_id) {
+    case PROP_WINDOW:
+      filter->window = g_value_get_uint (value);
+      break;
+    case PROP_SEARCH_RANGE:
+      filter->search_range = g_value_get_uint (value);
+      break;
+    case PROP_TOLERANCE:
+      filter->tolerance = g_value_get_uint (value);
+      break;
+    case PROP_METHOD:
+      filter->method = g_value_get_enum (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_tapconsensus_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstTapConsensus *filter = GST_TAP_CONSENSUS (object);
+
+  switch (prop_id) {
+    case PROP_WINDOW:
+      g_value_set_uint (value, filter->window);
+      break;
+    case PROP_SEARCH_RANGE:
+      g_value_set_uint (value, filter->search_range);
+      break;
+    case PROP_TOLERANCE:
+      g_value_set_uint (value, filter->tolerance);
+      break;
+    case PROP_METHOD:
+      g_value_set_enum (value, filter->method);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_tapconsensus_finalize (GObject * object)
+{
+  GstTapConsensus *filter = GST_TAP_CONSENSUS (object);
+
+  g_mutex_clear (&filter->mutex);
+  g_cond_clear (&filter->cond);
+
+  G_OBJECT_CLASS (gst_tapconsensus_parent_class)->finalize (object);
+}
+
+static void
+gst_tapconsensus_class_init (GstTapConsensusClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GstAggregatorClass *aggregator_class = GST_AGGREGATOR_CLASS (klass);
+
+  gobject_class->set_property = gst_tapconsensus_set_property;
+  gobject_class->get_property = gst_tapconsensus_get_property;
+  gobject_class->finalize = gst_tapconsensus_finalize;
+
+  aggregator_class->aggregate = GST_DEBUG_FUNCPTR (gst_tapconsensus_aggregate);
+  aggregator_class->flush = GST_DEBUG_FUNCPTR (gst_tapconsensus_flush);
+  aggregator_class->start = GST_DEBUG_FUNCPTR (gst_tapconsensus_start);
+  aggregator_class->stop = GST_DEBUG_FUNCPTR (gst_tapconsensus_stop);
+
+  gst_element_class_set_details_simple (element_class,
+      "Commodore 64 TAP consensus",
+      "Filter/Audio",
+      "Merges several captures of the same tape by aligning them and voting",
+      "Fabrizio Gennari <fabrizio.ge@tiscali.it>");
+
+  gst_element_class_add_static_pad_template_with_gtype (element_class,
+      &sink_template, GST_TYPE_AGGREGATOR_PAD);
+  gst_element_class_add_static_pad_template_with_gtype (element_class,
+      &src_template, GST_TYPE_AGGREGATOR_PAD);
+
+  g_object_class_install_property (gobject_class, PROP_WINDOW,
+      g_param_spec_uint ("window", "Window",
+          "Number of pulses aligned together",
+          16, G_MAXUINT, TAPCONSENSUS_DEFAULT_WINDOW,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_SEARCH_RANGE,
+      g_param_spec_uint ("search-range", "Search range",
+          "How many pulses an input may be shifted by, from one window to the next, to align it to the first input",
+          0, G_MAXUINT / TAPCONSENSUS_WIDE_SEARCH,
+          TAPCONSENSUS_DEFAULT_SEARCH_RANGE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_TOLERANCE,
+      g_param_spec_uint ("tolerance", "Tolerance",
+          "Maximum difference, in percent, between two pulses considered equal",
+          0, 100, TAPCONSENSUS_DEFAULT_TOLERANCE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_METHOD,
+      g_param_spec_enum ("method", "Method",
+          "How the output pulse is chosen among the inputs",
+          gst_methods_get_type (), TAPCONSENSUS_MEDIAN,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+
+  pulses_quark = g_quark_from_static_string ("tapconsensus-pulses");
+}
+
+static void
+gst_tapconsensus_init (GstTapConsensus * filter)
+{
+  g_mutex_init (&filter->mutex);
+  g_cond_init (&filter->cond);
+}
+
+gboolean
+gst_tapconsensus_register (GstPlugin * plugin)
+{
+  GST_DEBUG_CATEGORY_INIT (gst_tapconsensus_debug, "tapconsensus",
+      0, "Commodore TAP consensus");
+
+  return gst_element_register (plugin, "tapconsensus", GST_RANK_NONE,
+      GST_TYPE_TAP_CONSENSUS);
+}
@@ -70,8 +70,145 @@ struct _GstTapConvert
     wave_full_to_half
   } waves;
   GstPadGetRangeFunction base_getrange;
+  gboolean halfwave_input;
+  gboolean same_caps;
+
+  /* inrate, corrected by the tape speed */
+  gint divisor;
+  /* division by divisor, as a multiplication and a shift */
+  guint64 magic;
+  guint magic_shift;
+
+  gboolean error_diffusion;
+  /* what was left of the last division, in units of 1/divisor of an output
+   * unit */
+  guint64 remainder;
+
+  /* speed of the tape deck, compared to the speed it was recorded at */
+  gdouble speed;
+  /* set through the speed property, to be applied at the next buffer */
+  gdouble new_speed;
+  gboolean speed_changed;
+  gboolean speed_correction;
+  /* the current run of waves of about the same length, which might be a
+   * pilot tone */
+  guint64 run_sum;
+  guint run_len;
+  /* lengths of the ROM loader pilot waves, at the input rate */
+  guint64 pilot_length[6];
+  /* the pilots which can be found, and the one found first, -1 if none */
+  gint machine;
+  gint videotype;
+  gint pilot;
+
+  /* converting half waves to full waves, a half wave left over at the end of
+   * the last buffer, waiting for its other half */
+  gboolean half_pending;
+  guint32 pending_half;
+
+  /* in pull mode, where the last getrange call ended, on both sides */
+  guint64 next_inoffset;
+  guint64 next_outoffset;
+  /* in pull mode, converting full waves to half waves, the offset asked
+   * for was on the second half of a wave: the first half wave of the next
+   * output is not wanted */
+  gboolean drop_half;
+  /* in pull mode, caps have been negotiated since activation */
+  gboolean negotiated;
+
+  /* output buffers, when not converting in place */
+  GstBufferPool *pool;
+  gsize pool_size;
+};
+
+enum
+{
+  PROP_0,
+  PROP_ERROR_DIFFUSION,
+  PROP_SPEED_CORRECTION,
+  PROP_SPEED,
+  PROP_MACHINE,
+  PROP_VIDEOTYPE
+};
+
+#define TAPCONVERT_MACHINE_C64 0
+#define TAPCONVERT_MACHINE_VIC 1
+#define TAPCONVERT_MACHINE_C16 2
+#define TAPCONVERT_MACHINE_AUTO 3
+
+#define TAPCONVERT_VIDEOTYPE_PAL 0
+#define TAPCONVERT_VIDEOTYPE_NTSC 1
+#define TAPCONVERT_VIDEOTYPE_AUTO 2
+
+/* Full waves of the pilot tones written by the ROM loaders, in clock cycles,
+ * and the clocks, PAL and NTSC. Some pilots are less than 4% apart (C64 PAL
+ * and NTSC, C64 PAL and VIC NTSC), so a tape running a few percent fast or
+ * slow looks like one from another machine. The machine and videotype
+ * properties restrict the pilots looked for. Among those left, the first
+ * pilot found is kept for the rest of the stream, and only the drift around
+ * it is tracked */
+static const struct
+{
+  guint cycles;
+  guint clock;
+  gint machine;
+  gint videotype;
+} tapconvert_pilots[] = {
+  {0x30 * 8, 985248, TAPCONVERT_MACHINE_C64, TAPCONVERT_VIDEOTYPE_PAL},
+  {0x30 * 8, 1022727, TAPCONVERT_MACHINE_C64, TAPCONVERT_VIDEOTYPE_NTSC},
+  {0x36 * 8, 1108405, TAPCONVERT_MACHINE_VIC, TAPCONVERT_VIDEOTYPE_PAL},
+  {0x36 * 8, 1022727, TAPCONVERT_MACHINE_VIC, TAPCONVERT_VIDEOTYPE_NTSC},
+  {0x3A * 8, 886724, TAPCONVERT_MACHINE_C16, TAPCONVERT_VIDEOTYPE_PAL},
+  {0x3A * 8, 894886, TAPCONVERT_MACHINE_C16, TAPCONVERT_VIDEOTYPE_NTSC}
 };
 
+static GType
+gst_tapconvert_machine_get_type (void)
+{
+  static GType machine_type = 0;
+
+  if (machine_type == 0) {
+    static const GEnumValue machines[] = {
+      {TAPCONVERT_MACHINE_C64, "C64", "Commodore 64"},
+      {TAPCONVERT_MACHINE_C16, "C16", "Commodore 16/Plus-4"},
+      {TAPCONVERT_MACHINE_VIC, "VIC20", "Commodore VIC-20"},
+      {TAPCONVERT_MACHINE_AUTO, "auto", "Any machine"},
+      {0, NULL, NULL},
+    };
+    machine_type = g_enum_register_static ("GstTapConvertMachine", machines);
+  }
+
+  return machine_type;
+}
+
+static GType
+gst_tapconvert_videotype_get_type (void)
+{
+  static GType videotype_type = 0;
+
+  if (videotype_type == 0) {
+    static const GEnumValue videotypes[] = {
+      {TAPCONVERT_VIDEOTYPE_PAL, "PAL", "PAL"},
+      {TAPCONVERT_VIDEOTYPE_NTSC, "NTSC", "NTSC"},
+      {TAPCONVERT_VIDEOTYPE_AUTO, "auto", "Any video standard"},
+      {0, NULL, NULL},
+    };
+    videotype_type =
+        g_enum_register_static ("GstTapConvertVideotype", videotypes);
+  }
+
+  return videotype_type;
+}
+
+/* a wave continues a run if it is within this many percent of its mean */
+#define TAPCONVERT_RUN_TOLERANCE 5
+/* a run is a pilot if its mean is within this many percent of a known one */
+#define TAPCONVERT_PILOT_TOLERANCE 8
+/* the estimate of the speed is updated every so many waves of pilot */
+#define TAPCONVERT_PILOT_WINDOW 256
+/* and moves by this fraction of the difference with the new measure */
+#define TAPCONVERT_SPEED_SMOOTHING 8
+
 struct _GstTapConvertClass
 {
   GstBaseTransformClass parent_class;
@@ -107,17 +244,128 @@ static GstFlowReturn gst_tapconvert_transform (GstBaseTransform * trans,
     GstBuffer * inbuf, GstBuffer * outbuf);
 static GstCaps *gst_tapconvert_transform_caps (GstBaseTransform * trans,
     GstPadDirection direction, GstCaps * caps, GstCaps * filter);
+static GstCaps *gst_tapconvert_fixate_caps (GstBaseTransform * trans,
+    GstPadDirection direction, GstCaps * caps, GstCaps * othercaps);
 static gboolean gst_tapconvert_get_unit_size (GstBaseTransform * trans,
     GstCaps * caps, gsize * size);
+static gboolean gst_tapconvert_transform_size (GstBaseTransform * trans,
+    GstPadDirection direction, GstCaps * caps, gsize size, GstCaps * othercaps,
+    gsize * othersize);
 static GstFlowReturn gst_tapconvert_getrange (GstPad * pad, GstObject * parent,
     guint64 offset, guint length, GstBuffer ** buffer);
+static gboolean gst_tapconvert_start (GstBaseTransform * trans);
+static gboolean gst_tapconvert_stop (GstBaseTransform * trans);
+static GstFlowReturn gst_tapconvert_prepare_output_buffer (GstBaseTransform *
+    trans, GstBuffer * input, GstBuffer ** outbuf);
+static gboolean gst_tapconvert_sink_event (GstBaseTransform * trans,
+    GstEvent * event);
+static void gst_tapconvert_before_transform (GstBaseTransform * trans,
+    GstBuffer * buf);
+static void gst_tapconvert_update_passthrough (GstTapConvert * filter);
 /* GObject vmethod implementations */
 
+static void
+gst_tapconvert_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (object);
+
+  switch (prop_id) {
+    case PROP_ERROR_DIFFUSION:
+      filter->error_diffusion = g_value_get_boolean (value);
+      break;
+    case PROP_SPEED_CORRECTION:
+      filter->speed_correction = g_value_get_boolean (value);
+      gst_tapconvert_update_passthrough (filter);
+      break;
+    case PROP_SPEED:
+      GST_OBJECT_LOCK (filter);
+      filter->new_speed = g_value_get_double (value);
+      filter->speed_changed = TRUE;
+      GST_OBJECT_UNLOCK (filter);
+      gst_tapconvert_update_passthrough (filter);
+      break;
+    case PROP_MACHINE:
+      filter->machine = g_value_get_enum (value);
+      filter->pilot = -1;
+      break;
+    case PROP_VIDEOTYPE:
+      filter->videotype = g_value_get_enum (value);
+      filter->pilot = -1;
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gst_tapconvert_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (object);
+
+  switch (prop_id) {
+    case PROP_ERROR_DIFFUSION:
+      g_value_set_boolean (value, filter->error_diffusion);
+      break;
+    case PROP_SPEED_CORRECTION:
+      g_value_set_boolean (value, filter->speed_correction);
+      break;
+    case PROP_SPEED:
+      GST_OBJECT_LOCK (filter);
+      g_value_set_double (value,
+          filter->speed_changed ? filter->new_speed : filter->speed);
+      GST_OBJECT_UNLOCK (filter);
+      break;
+    case PROP_MACHINE:
+      g_value_set_enum (value, filter->machine);
+      break;
+    case PROP_VIDEOTYPE:
+      g_value_set_enum (value, filter->videotype);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
 /* initialize the plugin's class */
 static void
 gst_tapconvert_class_init (GstTapConvertClass * klass)
 {
   GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->set_property = gst_tapconvert_set_property;
+  gobject_class->get_property = gst_tapconvert_get_property;
+
+  g_object_class_install_property (gobject_class, PROP_ERROR_DIFFUSION,
+      g_param_spec_boolean ("error-diffusion", "Error diffusion",
+          "If true, what is lost rounding a pulse down is added to the next one, so that the total length of the stream is kept. Otherwise, every pulse is rounded down on its own",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_SPEED_CORRECTION,
+      g_param_spec_boolean ("speed-correction", "Speed correction",
+          "If true, the speed is continuously estimated from the pilot tones of the C64, VIC20 and C16 ROM loaders, and pulses are corrected accordingly",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_SPEED,
+      g_param_spec_double ("speed", "Speed",
+          "Speed of the tape deck, compared to the one the tape was recorded with. Pulses are multiplied by it. With speed correction, this is the current estimate, and setting it sets the starting point of the estimate",
+          0.5, 2.0, 1.0,
+          G_PARAM_READWRITE | GST_PARAM_CONTROLLABLE | G_PARAM_STATIC_STRINGS
+          | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_MACHINE,
+      g_param_spec_enum ("machine", "Machine",
+          "With speed correction, only look for the pilot tones of this machine",
+          gst_tapconvert_machine_get_type (), TAPCONVERT_MACHINE_AUTO,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_VIDEOTYPE,
+      g_param_spec_enum ("videotype", "Video type",
+          "With speed correction, only look for the pilot tones of machines with this video standard",
+          gst_tapconvert_videotype_get_type (), TAPCONVERT_VIDEOTYPE_AUTO,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
 
   GST_BASE_TRANSFORM_CLASS (klass)->transform_ip =
       GST_DEBUG_FUNCPTR (gst_tapconvert_transform_ip);
@@ -127,8 +375,22 @@ gst_tapconvert_class_init (GstTapConvertClass * klass)
       GST_DEBUG_FUNCPTR (gst_tapconvert_set_caps);
   GST_BASE_TRANSFORM_CLASS (klass)->transform_caps =
       GST_DEBUG_FUNCPTR (gst_tapconvert_transform_caps);
+  GST_BASE_TRANSFORM_CLASS (klass)->fixate_caps =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_fixate_caps);
   GST_BASE_TRANSFORM_CLASS (klass)->get_unit_size =
       GST_DEBUG_FUNCPTR (gst_tapconvert_get_unit_size);
+  GST_BASE_TRANSFORM_CLASS (klass)->transform_size =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_transform_size);
+  GST_BASE_TRANSFORM_CLASS (klass)->start =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_start);
+  GST_BASE_TRANSFORM_CLASS (klass)->stop =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_stop);
+  GST_BASE_TRANSFORM_CLASS (klass)->prepare_output_buffer =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_prepare_output_buffer);
+  GST_BASE_TRANSFORM_CLASS (klass)->sink_event =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_sink_event);
+  GST_BASE_TRANSFORM_CLASS (klass)->before_transform =
+      GST_DEBUG_FUNCPTR (gst_tapconvert_before_transform);
 
   gst_element_class_set_details_simple (element_class,
       "Commodore 64 TAP rate converter",
@@ -152,12 +414,273 @@ static void
 gst_tapconvert_init (GstTapConvert * filter)
 {
   GstBaseTransform *trans = GST_BASE_TRANSFORM (filter);
+  filter->speed = 1.0;
+  filter->pilot = -1;
   filter->base_getrange = trans->srcpad->getrangefunc;
   gst_pad_set_getrange_function (trans->srcpad, gst_tapconvert_getrange);
 }
 
+/* Division by divisor, which is inrate divided by the speed.
+ * Numerators are at most the sum of two 32-bit pulses times a rate below
+ * 2^21, so below 2^54. For those, with l = ceil(log2(divisor)),
+ * floor(n / divisor) = floor(n * m / 2^(54 + l)), where
+ * m = floor(2^(54 + l) / divisor) + 1 (Granlund and Montgomery, "Division by
+ * invariant integers using multiplication", theorem 4.2). m fits 64 bits,
+ * and a 64x64->128 bit multiplication is much faster than a 64-bit
+ * division. Without 128-bit integers, the division is done */
+
+#define TAPCONVERT_NUMERATOR_BITS 54
+
+static void
+gst_tapconvert_set_divisor (GstTapConvert * filter)
+{
+#ifdef __SIZEOF_INT128__
+  guint l = 0;
+
+  while ((G_GUINT64_CONSTANT (1) << l) < (guint64) filter->divisor)
+    l++;
+  filter->magic_shift = TAPCONVERT_NUMERATOR_BITS + l;
+  filter->magic = (guint64) ((((unsigned __int128) 1) << filter->magic_shift)
+      / (guint64) filter->divisor) + 1;
+#endif
+}
+
+static inline guint64
+gst_tapconvert_divide (GstTapConvert * filter, guint64 numerator)
+{
+#ifdef __SIZEOF_INT128__
+  return (guint64) (((unsigned __int128) numerator * filter->magic)
+      >> filter->magic_shift);
+#else
+  return numerator / (guint64) filter->divisor;
+#endif
+}
+
+/* the constant is more likely to be wrong near the largest numerator, and
+ * where the quotient changes */
+static void
+gst_tapconvert_check_divisor (GstTapConvert * filter)
+{
+  guint64 max = (G_GUINT64_CONSTANT (1) << TAPCONVERT_NUMERATOR_BITS) - 1;
+  guint64 multiple = max - max % (guint64) filter->divisor;
+
+  g_assert (gst_tapconvert_divide (filter, max) ==
+      max / (guint64) filter->divisor);
+  g_assert (gst_tapconvert_divide (filter, multiple) ==
+      multiple / (guint64) filter->divisor);
+  g_assert (gst_tapconvert_divide (filter, multiple - 1) ==
+      (multiple - 1) / (guint64) filter->divisor);
+}
+
+static void
+gst_tapconvert_apply_speed (GstTapConvert * filter, gdouble speed)
+{
+  gint divisor;
+
+  filter->speed = speed;
+  if (filter->inrate <= 0)
+    return;
+  divisor = MAX ((gint) (filter->inrate / speed + 0.5), 1);
+  if (divisor == filter->divisor)
+    return;
+  if (filter->divisor > 0)
+    filter->remainder = filter->remainder * divisor / filter->divisor;
+  filter->divisor = divisor;
+  gst_tapconvert_set_divisor (filter);
+  gst_tapconvert_check_divisor (filter);
+}
+
+/* picks up a speed set through the property, or a controller. TAP sources
+ * only stamp the decoding timestamp, so that is used when there is no
+ * presentation timestamp */
+static void
+gst_tapconvert_before_transform (GstBaseTransform * trans, GstBuffer * buf)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (trans);
+  GstClockTime timestamp = GST_BUFFER_PTS_IS_VALID (buf) ?
+      GST_BUFFER_PTS (buf) : GST_BUFFER_DTS (buf);
+
+  if (GST_CLOCK_TIME_IS_VALID (timestamp))
+    gst_object_sync_values (GST_OBJECT (filter),
+        gst_segment_to_stream_time (&trans->segment, GST_FORMAT_TIME,
+            timestamp));
+
+  GST_OBJECT_LOCK (filter);
+  if (filter->speed_changed)
+    gst_tapconvert_apply_speed (filter, filter->new_speed);
+  filter->speed_changed = FALSE;
+  GST_OBJECT_UNLOCK (filter);
+
+  /* control bindings can be added at any time */
+  gst_tapconvert_update_passthrough (filter);
+}
+
+/* feeds a full wave, at the input rate, to the pilot tone detection */
+static void
+gst_tapconvert_track (GstTapConvert * filter, guint64 wave)
+{
+  guint64 mean, deviation, best_deviation = 0;
+  guint i, best = G_N_ELEMENTS (tapconvert_pilots);
+  gdouble measured;
+
+  if (filter->run_len > 0) {
+    mean = filter->run_sum / filter->run_len;
+    deviation = wave > mean ? wave - mean : mean - wave;
+    if (deviation * 100 > mean * TAPCONVERT_RUN_TOLERANCE) {
+      filter->run_sum = wave;
+      filter->run_len = 1;
+      return;
+    }
+  }
+  filter->run_sum += wave;
+  filter->run_len++;
+  if (filter->run_len % TAPCONVERT_PILOT_WINDOW != 0)
+    return;
+
+  mean = filter->run_sum / filter->run_len;
+  /* keep the mean, forget the oldest waves */
+  if (filter->run_len >= 16 * TAPCONVERT_PILOT_WINDOW) {
+    filter->run_sum /= 2;
+    filter->run_len /= 2;
+  }
+  for (i = 0; i < G_N_ELEMENTS (tapconvert_pilots); i++) {
+    guint64 pilot = filter->pilot_length[i];
+
+    if (pilot == 0 || (filter->pilot >= 0 && i != (guint) filter->pilot)
+        || (filter->machine != TAPCONVERT_MACHINE_AUTO
+            && filter->machine != tapconvert_pilots[i].machine)
+        || (filter->videotype != TAPCONVERT_VIDEOTYPE_AUTO
+            && filter->videotype != tapconvert_pilots[i].videotype))
+      continue;
+    deviation = mean > pilot ? mean - pilot : pilot - mean;
+    if (deviation * 100 <= pilot * TAPCONVERT_PILOT_TOLERANCE
+        && (best == G_N_ELEMENTS (tapconvert_pilots)
+            || deviation < best_deviation)) {
+      best = i;
+      best_deviation = deviation;
+    }
+  }
+  if (best == G_N_ELEMENTS (tapconvert_pilots))
+    return;
+  if (filter->pilot < 0)
+    GST_DEBUG_OBJECT (filter, "found pilot %u", best);
+  filter->pilot = best;
+
+  measured = (gdouble) filter->pilot_length[best] / mean;
+  GST_LOG_OBJECT (filter, "pilot %u measured at speed %f", best, measured);
+  GST_OBJECT_LOCK (filter);
+  gst_tapconvert_apply_speed (filter, filter->speed
+      + (measured - filter->speed) / TAPCONVERT_SPEED_SMOOTHING);
+  GST_OBJECT_UNLOCK (filter);
+}
+
+/* converts a pulse, or the sum of two half waves, to the output rate */
+static inline guint32
+gst_tapconvert_convert (GstTapConvert * filter, guint64 pulse)
+{
+  guint64 numerator;
+  guint64 converted;
+
+  if (filter->speed_correction)
+    gst_tapconvert_track (filter, filter->halfwave_input
+        && filter->waves == wave_unchanged ? pulse * 2 : pulse);
+
+  numerator = pulse * filter->outrate;
+  if (!filter->error_diffusion)
+    return (guint32) gst_tapconvert_divide (filter, numerator);
+
+  numerator += filter->remainder;
+  converted = gst_tapconvert_divide (filter, numerator);
+  filter->remainder = numerator - converted * filter->divisor;
+  return (guint32) converted;
+}
+
+static void
+gst_tapconvert_reset (GstTapConvert * filter)
+{
+  filter->remainder = 0;
+  filter->half_pending = FALSE;
+  filter->run_sum = 0;
+  filter->run_len = 0;
+}
+
+/* at the end of the stream, a half wave without its other half becomes a
+ * pulse on its own */
+static GstBuffer *
+gst_tapconvert_flush_pending (GstTapConvert * filter)
+{
+  GstBuffer *buf;
+  guint32 pulse;
+
+  if (!filter->half_pending)
+    return NULL;
+
+  filter->half_pending = FALSE;
+  pulse = gst_tapconvert_convert (filter, filter->pending_half);
+  buf = gst_buffer_new_allocate (NULL, sizeof (pulse), NULL);
+  gst_buffer_fill (buf, 0, &pulse, sizeof (pulse));
+
+  return buf;
+}
+
 /* GstBaseTransform vmethod implementations */
 
+static gboolean
+gst_tapconvert_start (GstBaseTransform * trans)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (trans);
+
+  gst_tapconvert_reset (filter);
+  filter->next_inoffset = filter->next_outoffset = 0;
+  filter->drop_half = FALSE;
+  filter->negotiated = FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+gst_tapconvert_stop (GstBaseTransform * trans)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (trans);
+
+  if (filter->pool) {
+    gst_buffer_pool_set_active (filter->pool, FALSE);
+    gst_object_unref (filter->pool);
+    filter->pool = NULL;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+gst_tapconvert_sink_event (GstBaseTransform * trans, GstEvent * event)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (trans);
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_FLUSH_STOP:
+      gst_tapconvert_reset (filter);
+      break;
+    case GST_EVENT_EOS:{
+      GstBuffer *buf = gst_tapconvert_flush_pending (filter);
+
+      if (buf) {
+        GstFlowReturn ret = gst_pad_push (trans->srcpad, buf);
+
+        if (ret != GST_FLOW_OK)
+          GST_DEBUG_OBJECT (filter, "pushing the last half wave failed: %s",
+              gst_flow_get_name (ret));
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  return GST_BASE_TRANSFORM_CLASS (gst_tapconvert_parent_class)->sink_event
+      (trans, event);
+}
+
 static GstFlowReturn
 gst_tapconvert_transform_ip (GstBaseTransform * base, GstBuffer * outbuf)
 {
@@ -171,13 +694,9 @@ gst_tapconvert_transform_ip (GstBaseTransform * base, GstBuffer * outbuf)
     return GST_FLOW_ERROR;
   data = (guint32 *) map.data;
   buflen = map.size / sizeof (guint32);
-  if (GST_CLOCK_TIME_IS_VALID (GST_BUFFER_TIMESTAMP (outbuf)))
-    gst_object_sync_values (GST_OBJECT (filter), GST_BUFFER_TIMESTAMP (outbuf));
 
-  for (bufsofar = 0; bufsofar < buflen; bufsofar++) {
-    guint64 pulse = (guint64) data[bufsofar] * filter->outrate;
-    data[bufsofar] = (guint32) (pulse / filter->inrate);
-  }
+  for (bufsofar = 0; bufsofar < buflen; bufsofar++)
+    data[bufsofar] = gst_tapconvert_convert (filter, data[bufsofar]);
 
   return GST_FLOW_OK;
 }
@@ -187,7 +706,7 @@ gst_tapconvert_transform (GstBaseTransform * trans, GstBuffer * inbuf,
     GstBuffer * outbuf)
 {
   GstTapConvert *filter = GST_TAP_CONVERT (trans);
-  guint buflen;
+  guint buflen, outbuflen;
   guint inbufsofar, outbufsofar;
   guint *indata, *outdata;
   GstMapInfo inmap, outmap;
@@ -204,23 +723,40 @@ gst_tapconvert_transform (GstBaseTransform * trans, GstBuffer * inbuf,
       outbufsofar = 0;
 
       for (inbufsofar = 0; inbufsofar < buflen; inbufsofar++) {
-        guint64 pulse = (guint64) indata[inbufsofar] * filter->outrate;
-        guint32 converted_pulse = pulse / filter->inrate;
+        guint32 converted_pulse =
+            gst_tapconvert_convert (filter, indata[inbufsofar]);
         outdata[outbufsofar] = (guint32) converted_pulse / 2;
         outdata[outbufsofar + 1] = converted_pulse - outdata[outbufsofar];
         outbufsofar += 2;
       }
       ret = GST_FLOW_OK;
     } else if (filter->waves == wave_half_to_full) {
-      buflen = outmap.size / sizeof (guint32);
+      buflen = inmap.size / sizeof (guint32);
+      outbuflen = outmap.size / sizeof (guint32);
       inbufsofar = 0;
+      outbufsofar = 0;
 
-      for (outbufsofar = 0; outbufsofar < buflen; outbufsofar++) {
-        guint64 pulse = (guint64) indata[inbufsofar++] * filter->outrate;
-        pulse += indata[inbufsofar++] * filter->outrate;
-        outdata[outbufsofar] = pulse / filter->inrate;
+      if (filter->half_pending && buflen > 0 && outbuflen > 0) {
+        guint64 pulse = (guint64) filter->pending_half;
+        pulse += indata[inbufsofar++];
+        outdata[outbufsofar++] = gst_tapconvert_convert (filter, pulse);
+        filter->half_pending = FALSE;
       }
-      ret = GST_FLOW_OK;
+      for (; inbufsofar + 1 < buflen && outbufsofar < outbuflen;
+          outbufsofar++) {
+        guint64 pulse = (guint64) indata[inbufsofar++];
+        pulse += indata[inbufsofar++];
+        outdata[outbufsofar] = gst_tapconvert_convert (filter, pulse);
+      }
+      /* the offset end tells where to resume from, so it must not cover a
+       * half wave that is not in the output yet. The error diffusion
+       * remainder is less than one output sample, and is not withheld */
+      if (inbufsofar < buflen) {
+        filter->pending_half = indata[inbufsofar];
+        filter->half_pending = TRUE;
+        GST_BUFFER_OFFSET_END (outbuf) = GST_BUFFER_OFFSET_NONE;
+      }
+      ret = outbufsofar > 0 ? GST_FLOW_OK : GST_BASE_TRANSFORM_FLOW_DROPPED;
     }
     gst_buffer_unmap (outbuf, &outmap);
   }
@@ -254,9 +790,27 @@ gst_tapconvert_set_caps (GstBaseTransform * trans, GstCaps * incaps,
     GST_WARNING_OBJECT (filter, "output caps have no rate");
   gboolean ret = ret1 && ret2 && ret3 && ret4;
 
+  gst_tapconvert_reset (filter);
+  if (ret1 && filter->inrate > 0) {
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (tapconvert_pilots); i++)
+      filter->pilot_length[i] =
+          gst_util_uint64_scale_round (tapconvert_pilots[i].cycles,
+          filter->inrate, tapconvert_pilots[i].clock);
+    filter->pilot = -1;
+    filter->divisor = 0;
+    GST_OBJECT_LOCK (filter);
+    gst_tapconvert_apply_speed (filter,
+        filter->speed_changed ? filter->new_speed : filter->speed);
+    filter->speed_changed = FALSE;
+    GST_OBJECT_UNLOCK (filter);
+  }
+
   GST_DEBUG_OBJECT (trans, "from: %" GST_PTR_FORMAT, instructure);
   GST_DEBUG_OBJECT (trans, "to: %" GST_PTR_FORMAT, outstructure);
 
+  filter->halfwave_input = inhalfwaves;
   if (inhalfwaves == outhalfwaves) {
     gst_base_transform_set_in_place (trans, TRUE);
     filter->waves = wave_unchanged;
@@ -264,6 +818,9 @@ gst_tapconvert_set_caps (GstBaseTransform * trans, GstCaps * incaps,
     gst_base_transform_set_in_place (trans, FALSE);
     filter->waves = inhalfwaves ? wave_half_to_full : wave_full_to_half;
   }
+  filter->same_caps = ret
+      && filter->waves == wave_unchanged && filter->inrate == filter->outrate;
+  gst_tapconvert_update_passthrough (filter);
 
   if (!ret)
     GST_WARNING_OBJECT (filter, "incomplete caps");
@@ -271,31 +828,188 @@ gst_tapconvert_set_caps (GstBaseTransform * trans, GstCaps * incaps,
   return ret;
 }
 
+/* with the same caps on both sides, and the speed left alone, there is
+ * nothing to do: buffers are not even mapped */
+static void
+gst_tapconvert_update_passthrough (GstTapConvert * filter)
+{
+  gboolean passthrough;
+
+  GST_OBJECT_LOCK (filter);
+  passthrough = filter->same_caps && !filter->speed_correction
+      && (filter->speed_changed ? filter->new_speed : filter->speed) == 1.0;
+  GST_OBJECT_UNLOCK (filter);
+  if (passthrough
+      && gst_object_has_active_control_bindings (GST_OBJECT (filter)))
+    passthrough = FALSE;
+  gst_base_transform_set_passthrough (GST_BASE_TRANSFORM (filter),
+      passthrough);
+}
+
+/* a half wave can be left waiting for the next buffer, so buffers of any
+ * number of pulses are accepted */
 static gboolean
 gst_tapconvert_get_unit_size (GstBaseTransform * trans,
     GstCaps * caps, gsize * size)
 {
-  GstStructure *structure = gst_caps_get_structure (caps, 0);
-  gboolean halfwaves;
+  *size = sizeof (guint32);
+
+  return TRUE;
+}
+
+/* how many bytes come out of an input buffer, given what is waiting from
+ * the previous buffer */
+static gsize
+gst_tapconvert_output_size (GstTapConvert * filter, gsize size)
+{
+  gsize pulses = size / sizeof (guint32);
+
+  if (filter->waves == wave_full_to_half)
+    pulses *= 2;
+  else if (filter->waves == wave_half_to_full)
+    pulses = (pulses + (filter->half_pending ? 1 : 0)) / 2;
+
+  return pulses * sizeof (guint32);
+}
+
+/* how many bytes must go in to fill an output buffer */
+static gsize
+gst_tapconvert_input_size (GstTapConvert * filter, gsize size)
+{
+  gsize pulses = size / sizeof (guint32);
+
+  if (filter->waves == wave_full_to_half)
+    pulses = MAX (pulses / 2, 1);
+  else if (filter->waves == wave_half_to_full && pulses > 0)
+    pulses = pulses * 2 - (filter->half_pending ? 1 : 0);
+
+  return pulses * sizeof (guint32);
+}
+
+static gboolean
+gst_tapconvert_transform_size (GstBaseTransform * trans,
+    GstPadDirection direction, GstCaps * caps, gsize size, GstCaps * othercaps,
+    gsize * othersize)
+{
   GstTapConvert *filter = GST_TAP_CONVERT (trans);
 
-  if (!gst_structure_get_boolean (structure, "halfwaves", &halfwaves))
-    return FALSE;
-  *size = sizeof (guint32);
-  if (halfwaves && (filter->waves == wave_full_to_half
-          || filter->waves == wave_half_to_full))
-    *size *= 2;
+  *othersize = direction == GST_PAD_SINK ?
+      gst_tapconvert_output_size (filter, size) :
+      gst_tapconvert_input_size (filter, size);
 
   return TRUE;
 }
 
+/* output buffers come from a pool of buffers large enough for the largest
+ * output so far, trimmed to the size of each output */
+static GstFlowReturn
+gst_tapconvert_prepare_output_buffer (GstBaseTransform * trans,
+    GstBuffer * input, GstBuffer ** outbuf)
+{
+  GstTapConvert *filter = GST_TAP_CONVERT (trans);
+  GstBaseTransformClass *klass = GST_BASE_TRANSFORM_GET_CLASS (trans);
+  gsize size;
+  GstFlowReturn ret;
+
+  if (gst_base_transform_is_passthrough (trans)
+      || gst_base_transform_is_in_place (trans))
+    return
+        GST_BASE_TRANSFORM_CLASS
+        (gst_tapconvert_parent_class)->prepare_output_buffer (trans, input,
+        outbuf);
+
+  size = gst_tapconvert_output_size (filter, gst_buffer_get_size (input));
+  if (filter->pool == NULL || filter->pool_size < size) {
+    GstStructure *config;
+
+    if (filter->pool) {
+      gst_buffer_pool_set_active (filter->pool, FALSE);
+      gst_object_unref (filter->pool);
+    }
+    filter->pool = gst_buffer_pool_new ();
+    filter->pool_size = MAX (size, sizeof (guint32));
+    config = gst_buffer_pool_get_config (filter->pool);
+    gst_buffer_pool_config_set_params (config, NULL, filter->pool_size, 0, 0);
+    if (!gst_buffer_pool_set_config (filter->pool, config)
+        || !gst_buffer_pool_set_active (filter->pool, TRUE)) {
+      GST_ERROR_OBJECT (filter, "cannot set up the buffer pool");
+      gst_object_unref (filter->pool);
+      filter->pool = NULL;
+      return GST_FLOW_ERROR;
+    }
+  }
+
+  ret = gst_buffer_pool_acquire_buffer (filter->pool, outbuf, NULL);
+  if (ret != GST_FLOW_OK)
+    return ret;
+  gst_buffer_resize (*outbuf, 0, size);
+  if (klass->copy_metadata)
+    klass->copy_metadata (trans, input, *outbuf);
+
+  return GST_FLOW_OK;
+}
+
+/* anything can be converted to anything, but the same caps come first, so
+ * that no conversion is preferred */
 static GstCaps *
 gst_tapconvert_transform_caps (GstBaseTransform * trans,
     GstPadDirection direction, GstCaps * caps, GstCaps * filter)
 {
+  GstCaps *ret;
+
   GST_DEBUG_OBJECT (trans, "direction %s from: %" GST_PTR_FORMAT,
       direction == GST_PAD_SRC ? "src" : "sink", caps);
-  return gst_pad_get_pad_template_caps (direction == GST_PAD_SRC ? trans->sinkpad : trans->srcpad);
+  ret = gst_caps_merge (gst_caps_copy (caps),
+      gst_pad_get_pad_template_caps (direction ==
+          GST_PAD_SRC ? trans->sinkpad : trans->srcpad));
+  if (filter) {
+    GstCaps *intersection =
+        gst_caps_intersect_full (filter, ret, GST_CAPS_INTERSECT_FIRST);
+
+    gst_caps_unref (ret);
+    ret = intersection;
+  }
+  GST_DEBUG_OBJECT (trans, "to: %" GST_PTR_FORMAT, ret);
+
+  return ret;
+}
+
+/* chooses, among the structures acceptable on the other side, the first
+ * which allows the same rate and halfwaves, then fixates to the nearest
+ * rate and the same halfwaves */
+static GstCaps *
+gst_tapconvert_fixate_caps (GstBaseTransform * trans,
+    GstPadDirection direction, GstCaps * caps, GstCaps * othercaps)
+{
+  GstStructure *structure = gst_caps_get_structure (caps, 0);
+  GstStructure *otherstructure;
+  gint rate;
+  gboolean halfwaves;
+  guint i;
+
+  for (i = 0; i < gst_caps_get_size (othercaps); i++)
+    if (gst_structure_can_intersect (structure,
+            gst_caps_get_structure (othercaps, i)))
+      break;
+  if (i < gst_caps_get_size (othercaps)) {
+    GstCaps *preferred = gst_caps_copy_nth (othercaps, i);
+
+    gst_caps_unref (othercaps);
+    othercaps = preferred;
+  } else
+    othercaps = gst_caps_truncate (othercaps);
+
+  othercaps = gst_caps_make_writable (othercaps);
+  otherstructure = gst_caps_get_structure (othercaps, 0);
+  if (gst_structure_get_int (structure, "rate", &rate))
+    gst_structure_fixate_field_nearest_int (otherstructure, "rate", rate);
+  if (gst_structure_get_boolean (structure, "halfwaves", &halfwaves))
+    gst_structure_fixate_field_boolean (otherstructure, "halfwaves",
+        halfwaves);
+  othercaps = gst_caps_fixate (othercaps);
+  GST_DEBUG_OBJECT (trans, "fixated to %" GST_PTR_FORMAT, othercaps);
+
+  return othercaps;
 }
 
 /* work around the brokenness of gst_base_transform_getrange */
@@ -309,45 +1023,75 @@ gst_tapconvert_getrange (GstPad * pad, GstObject * parent, guint64 offset,
   GstFlowReturn ret;
   GstBuffer *inbuf = NULL;
   GstBuffer *outbuf = NULL;
-  gsize other_length;
-  GstCaps *incaps, *outcaps;
 
-  ret = klass->submit_input_buffer (trans, FALSE, gst_buffer_new ());
-  if (ret != GST_FLOW_OK) {
-    if (ret != GST_FLOW_NOT_NEGOTIATED)
-      goto pull_error;
-  } else {
-    gst_buffer_unref (trans->queued_buf);
-    trans->queued_buf = NULL;
+  /* an empty buffer makes the base class negotiate, once after activation */
+  if (!filter->negotiated) {
+    ret = klass->submit_input_buffer (trans, FALSE, gst_buffer_new ());
+    if (ret != GST_FLOW_OK) {
+      if (ret != GST_FLOW_NOT_NEGOTIATED)
+        goto pull_error;
+    } else {
+      gst_buffer_unref (trans->queued_buf);
+      trans->queued_buf = NULL;
+      filter->negotiated = TRUE;
+    }
   }
 
   if (filter->waves == wave_unchanged)
     return filter->base_getrange (pad, parent, offset, length, buffer);
 
-  incaps = gst_pad_get_current_caps (trans->sinkpad);
-  outcaps = gst_pad_get_current_caps (pad);
-
-  if (!klass->transform_size (trans, GST_PAD_SRC, outcaps, length, incaps,
-          &other_length)) {
-    ret = GST_FLOW_ERROR;
-    goto pull_error;
+  /* not where the last call ended: the two sides are no longer aligned */
+  if (offset != filter->next_outoffset) {
+    filter->half_pending = FALSE;
+    if (filter->waves == wave_half_to_full) {
+      filter->next_inoffset = offset * 2;
+      filter->drop_half = FALSE;
+    } else {
+      filter->next_inoffset = offset / (2 * sizeof (guint32))
+          * sizeof (guint32);
+      filter->drop_half = offset / sizeof (guint32) % 2;
+    }
   }
 
-  ret = gst_pad_pull_range (trans->sinkpad, offset, other_length, &inbuf);
-  if (G_UNLIKELY (ret != GST_FLOW_OK))
-    goto pull_error;
+  /* a single half wave gives no output, then more must be pulled */
+  do {
+    ret = gst_pad_pull_range (trans->sinkpad, filter->next_inoffset,
+        gst_tapconvert_input_size (filter, length), &inbuf);
+    if (ret == GST_FLOW_EOS && filter->half_pending) {
+      outbuf = gst_tapconvert_flush_pending (filter);
+      ret = GST_FLOW_OK;
+      break;
+    }
+    if (G_UNLIKELY (ret != GST_FLOW_OK))
+      goto pull_error;
+    filter->next_inoffset += gst_buffer_get_size (inbuf);
 
-  if (klass->before_transform)
-    klass->before_transform (trans, inbuf);
+    if (klass->before_transform)
+      klass->before_transform (trans, inbuf);
 
-  ret = klass->submit_input_buffer (trans, FALSE, inbuf);
-  if (ret != GST_FLOW_OK) {
-    if (ret == GST_BASE_TRANSFORM_FLOW_DROPPED)
+    ret = klass->submit_input_buffer (trans, FALSE, inbuf);
+    if (ret == GST_BASE_TRANSFORM_FLOW_DROPPED) {
       ret = GST_FLOW_OK;
-    goto done;
+      continue;
+    }
+    if (ret != GST_FLOW_OK)
+      goto done;
+    ret = klass->generate_output (trans, &outbuf);
+    if (ret == GST_BASE_TRANSFORM_FLOW_DROPPED) {
+      if (outbuf)
+        gst_buffer_unref (outbuf);
+      outbuf = NULL;
+      ret = GST_FLOW_OK;
+    }
+  } while (ret == GST_FLOW_OK && outbuf == NULL);
+
+  if (outbuf && filter->drop_half) {
+    gst_buffer_resize (outbuf, sizeof (guint32), -1);
+    filter->drop_half = FALSE;
   }
-  ret = klass->generate_output (trans, &outbuf);
 
+  if (outbuf)
+    filter->next_outoffset = offset + gst_buffer_get_size (outbuf);
   *buffer = outbuf;
 done:
   return ret;
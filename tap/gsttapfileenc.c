@@ -52,6 +52,36 @@
  * gst-launch -v -m fakesrc ! tapenc ! tapfileenc ! fakesink silent=TRUE
  * ]|
  * </refsect2>
+ *
+ * With checkpoint-file set, the state of the encoder is saved in that file
+ * every checkpoint-interval seconds, together with the offset end of the
+ * last input buffer, which for tapenc is the input position of the last
+ * pulse. The checkpoint is only saved once downstream has answered a drain
+ * query, so all the output it refers to has reached the sink. Elements
+ * between tapenc and tapfileenc must keep the offset end, and clear it when
+ * they hold back part of their input, as tapconvert does with a half wave.
+ * No checkpoint is saved while the output goes to a temporary file. If the
+ * conversion is interrupted, running it again with
+ * resume=true on both tapenc and tapfileenc, and the same checkpoint-file,
+ * appends to the partial output. The sink must seek to the resume point
+ * without truncating the file, for example
+ * |[
+ * gst-launch-1.0 filesrc location=tape.wav ! wavparse ! audioconvert ! tapenc checkpoint-file=tape.ckpt resume=true ! tapconvert ! tapfileenc checkpoint-file=tape.ckpt resume=true ! fdsink fd=3 3<>grozo.tap
+ * ]|
+ *
+ * The length of the data is in the header, so normally the header is
+ * written again at EOS, which requires downstream to seek. If downstream
+ * says it cannot seek, and length-hint is set, the header is written with
+ * that length, and not written again. Otherwise, the data is kept in a
+ * temporary file, and all is pushed at EOS, header first.
+ *
+ * With machine=auto or videotype=auto, the input can have any rate. The
+ * first pulses are held back, and compared with the lengths of the pulses
+ * written by the ROM saver of each machine, with each video type: the
+ * closest one goes in the header, and the pulses are scaled to its clock.
+ * C64 and VIC-20 PAL ROM tapes have the same timings, so machine=auto only
+ * chooses between C64 and C16: VIC-20 tapes need machine=VIC20. With
+ * neither set to auto, the input must have the clock rate of the machine.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -59,8 +89,12 @@
 #endif
 
 #include <gst/gst.h>
-#include <gst/base/gstbytewriter.h>
 #include <string.h>
+#include <stdio.h>
+#include <glib/gstdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "gsttapfileenc.h"
 
@@ -87,12 +121,37 @@ struct _GstTapFileEnc
 
   gboolean sent_header;
   gboolean force_version_0;
+  guchar machine_setting;
+  guchar video_setting;
   guchar machine_byte;
   guchar video_byte;
   guchar version;
   gboolean last_was_overflow;
 
   guint length;
+
+  gchar *checkpoint_file;
+  guint checkpoint_interval;
+  gboolean resume;
+  gint64 last_checkpoint;
+  guint64 input_offset;
+
+  guint length_hint;
+  enum
+  {
+    output_seekable,
+    output_length_hint,
+    output_spool
+  } output;
+  FILE *spool;
+  gchar *spool_path;
+
+  gint rate;
+  gboolean halfwaves;
+  gboolean detecting;
+  GArray *prefix;
+  GArray *scaled;
+  guint64 scale_error;
 };
 
 struct _GstTapFileEncClass
@@ -115,20 +174,47 @@ enum
   PROP_0,
   PROP_MACHINE_BYTE,
   PROP_VIDEO_BYTE,
-  PROP_FORCE_VERSION_0
+  PROP_FORCE_VERSION_0,
+  PROP_CHECKPOINT_FILE,
+  PROP_CHECKPOINT_INTERVAL,
+  PROP_RESUME,
+  PROP_LENGTH_HINT
 };
 
+#define TAP_HEADER_SIZE 20
+#define TAPFILEENC_DEFAULT_CHECKPOINT_INTERVAL 10
+#define TAPFILEENC_DETECT_PULSES 16384
+/* per mille */
+#define TAPFILEENC_DETECT_TOLERANCE 100
+
 static const guint tap_clocks[][2] = {
   {985248, 1022727},            /* C64 */
   {1108405, 1022727},           /* VIC */
   {886724, 894886}              /* C16 */
 };
 
+/* Lengths of the full waves written by the ROM saver, in clock cycles:
+ * short (also used for the pilot), medium and long */
+static const guint tap_rom_pulses[][3] = {
+  {0x30 * 8, 0x42 * 8, 0x56 * 8},       /* C64 */
+  {0x36 * 8, 0x4A * 8, 0x61 * 8},       /* VIC */
+  {0x3A * 8, 0x74 * 8, 0xE8 * 8}        /* C16 */
+};
+
 /* the capabilities of the inputs and outputs.
  *
- * describe the real formats here.
+ * describe the real formats here. Any rate is accepted only when the
+ * machine or the video type is detected: otherwise, the sink pad has the
+ * template with the clocks of the machines
  */
 static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap, " "rate = (int) [ 1, MAX ]")
+    );
+
+static GstStaticPadTemplate sink_clock_factory =
+GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS ("audio/x-tap, "
@@ -143,6 +229,8 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
 
 G_DEFINE_TYPE (GstTapFileEnc, gst_tapfileenc, GST_TYPE_ELEMENT);
 
+static void gst_tapfileenc_update_template (GstTapFileEnc * filter);
+
 /* GObject vmethod implementations */
 
 static void
@@ -153,14 +241,29 @@ gst_tapfileenc_set_property (GObject * object, guint prop_id,
 
   switch (prop_id) {
     case PROP_MACHINE_BYTE:
-      filter->machine_byte = (guchar) g_value_get_enum (value);
+      filter->machine_setting = (guchar) g_value_get_enum (value);
+      gst_tapfileenc_update_template (filter);
       break;
     case PROP_VIDEO_BYTE:
-      filter->video_byte = (guchar) g_value_get_enum (value);
+      filter->video_setting = (guchar) g_value_get_enum (value);
+      gst_tapfileenc_update_template (filter);
       break;
     case PROP_FORCE_VERSION_0:
       filter->force_version_0 = g_value_get_boolean (value);
       break;
+    case PROP_CHECKPOINT_FILE:
+      g_free (filter->checkpoint_file);
+      filter->checkpoint_file = g_value_dup_string (value);
+      break;
+    case PROP_CHECKPOINT_INTERVAL:
+      filter->checkpoint_interval = g_value_get_uint (value);
+      break;
+    case PROP_RESUME:
+      filter->resume = g_value_get_boolean (value);
+      break;
+    case PROP_LENGTH_HINT:
+      filter->length_hint = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -175,14 +278,26 @@ gst_tapfileenc_get_property (GObject * object, guint prop_id,
 
   switch (prop_id) {
     case PROP_MACHINE_BYTE:
-      g_value_set_enum (value, filter->machine_byte);
+      g_value_set_enum (value, filter->machine_setting);
       break;
     case PROP_VIDEO_BYTE:
-      g_value_set_enum (value, filter->video_byte);
+      g_value_set_enum (value, filter->video_setting);
       break;
     case PROP_FORCE_VERSION_0:
       g_value_set_boolean (value, filter->force_version_0);
       break;
+    case PROP_CHECKPOINT_FILE:
+      g_value_set_string (value, filter->checkpoint_file);
+      break;
+    case PROP_CHECKPOINT_INTERVAL:
+      g_value_set_uint (value, filter->checkpoint_interval);
+      break;
+    case PROP_RESUME:
+      g_value_set_boolean (value, filter->resume);
+      break;
+    case PROP_LENGTH_HINT:
+      g_value_set_uint (value, filter->length_hint);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -194,11 +309,13 @@ gst_tapfileenc_get_property (GObject * object, guint prop_id,
 #define TAP_MACHINE_VIC 1
 #define TAP_MACHINE_C16 2
 #define TAP_MACHINE_MAX 2
+#define TAP_MACHINE_AUTO 3
 
 /* Video standards */
 #define TAP_VIDEOTYPE_PAL  0
 #define TAP_VIDEOTYPE_NTSC 1
 #define TAP_VIDEOTYPE_MAX  1
+#define TAP_VIDEOTYPE_AUTO 2
 
 static GType
 gst_machines_get_type (void)
@@ -210,6 +327,7 @@ gst_machines_get_type (void)
       {TAP_MACHINE_C64, "C64", "Commodore 64"},
       {TAP_MACHINE_C16, "C16", "Commodore 16/Plus-4"},
       {TAP_MACHINE_VIC, "VIC20", "Commodore VIC-20"},
+      {TAP_MACHINE_AUTO, "auto", "Detect from the pulses, C64 or C16"},
       {0, NULL, NULL},
     };
     machines_type =
@@ -228,6 +346,7 @@ gst_videotypes_get_type (void)
     static const GEnumValue videotypes_profiles[] = {
       {TAP_VIDEOTYPE_PAL, "PAL", "PAL"},
       {TAP_VIDEOTYPE_NTSC, "NTSC", "NTSC"},
+      {TAP_VIDEOTYPE_AUTO, "auto", "Detect from the pulses"},
       {0, NULL, NULL},
     };
     videotypes_type =
@@ -237,6 +356,33 @@ gst_videotypes_get_type (void)
   return videotypes_type;
 }
 
+static void
+gst_tapfileenc_close_spool (GstTapFileEnc * filter)
+{
+  if (filter->spool != NULL) {
+    fclose (filter->spool);
+    filter->spool = NULL;
+  }
+  if (filter->spool_path != NULL) {
+    g_unlink (filter->spool_path);
+    g_free (filter->spool_path);
+    filter->spool_path = NULL;
+  }
+}
+
+static void
+gst_tapfileenc_finalize (GObject * object)
+{
+  GstTapFileEnc *filter = GST_TAPFILEENC (object);
+
+  g_free (filter->checkpoint_file);
+  gst_tapfileenc_close_spool (filter);
+  g_array_free (filter->prefix, TRUE);
+  g_array_free (filter->scaled, TRUE);
+
+  G_OBJECT_CLASS (gst_tapfileenc_parent_class)->finalize (object);
+}
+
 /* initialize the tapfileenc's class */
 static void
 gst_tapfileenc_class_init (GstTapFileEncClass * klass)
@@ -248,6 +394,7 @@ gst_tapfileenc_class_init (GstTapFileEncClass * klass)
 
   gobject_class->set_property = gst_tapfileenc_set_property;
   gobject_class->get_property = gst_tapfileenc_get_property;
+  gobject_class->finalize = gst_tapfileenc_finalize;
 
   g_object_class_install_property (gobject_class, PROP_MACHINE_BYTE,
       g_param_spec_enum ("machine", "Machine",
@@ -264,6 +411,29 @@ gst_tapfileenc_class_init (GstTapFileEncClass * klass)
           "If true, and incoming stream is not halfwaves, a version 0 TAP file will be created. Otherwise the version will be 1 for full waves and 2 for halfwaves.",
           FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_CHECKPOINT_FILE,
+      g_param_spec_string ("checkpoint-file", "Checkpoint file",
+          "File where the progress of the conversion is saved, so that it can be resumed",
+          NULL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_CHECKPOINT_INTERVAL,
+      g_param_spec_uint ("checkpoint-interval", "Checkpoint interval",
+          "Seconds between two saves of checkpoint-file",
+          1, G_MAXUINT, TAPFILEENC_DEFAULT_CHECKPOINT_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_RESUME,
+      g_param_spec_boolean ("resume", "Resume",
+          "Append to the output from the point saved in checkpoint-file, instead of starting a new file",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_LENGTH_HINT,
+      g_param_spec_uint ("length-hint", "Length hint",
+          "Length of the data in bytes, written in the header when downstream cannot seek, so that the output can be streamed. If the real length turns out different, a warning is posted. 0 = unknown, keep the output in a temporary file until EOS",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
 
   gst_element_class_set_details_simple (element_class,
       "Commodore 64 TAP file writer",
@@ -306,26 +476,501 @@ write_header (GstPad * pad, guchar version, guchar machine_byte,
   return gst_pad_push (pad, buf);
 }
 
-/* chain function
- * this function does the actual processing
- */
+/* Packing.
+ * The exact size of the output is computed first, so that it is allocated
+ * once, then pulses are packed. Almost all pulses are below OVERFLOW_LO,
+ * and become a single byte: with SSE2, groups of 8 of them are divided by
+ * 8 and narrowed to bytes together, and only groups containing a longer
+ * pulse go through the byte by byte path */
+
+static gsize
+gst_tapfileenc_pulse_size (guint32 pulse)
+{
+  gsize size = 4 * (pulse / OVERFLOW_HI);
+
+  return size + (pulse % OVERFLOW_HI >= OVERFLOW_LO ? 4 : 1);
+}
+
+static gsize
+gst_tapfileenc_packed_size (GstTapFileEnc * filter, const guint32 * data,
+    guint len)
+{
+  gsize size = 0;
+  guint i = 0;
+
+  if (filter->version == 0)
+    return len;
+
+#ifdef __SSE2__
+  for (; i + 4 <= len; i += 4) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (data + i));
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (_mm_srli_epi32 (v, 11),
+                _mm_setzero_si128 ())) == 0xFFFF)
+      size += 4;
+    else {
+      guint j;
+      for (j = i; j < i + 4; j++)
+        size += gst_tapfileenc_pulse_size (data[j]);
+    }
+  }
+#endif
+  for (; i < len; i++)
+    size += gst_tapfileenc_pulse_size (data[i]);
+
+  return size;
+}
+
+static guint8 *
+gst_tapfileenc_pack_pulse (GstTapFileEnc * filter, guint32 pulse,
+    guint8 * out)
+{
+  if (filter->version == 0) {
+    if (pulse >= OVERFLOW_LO && !filter->last_was_overflow) {
+      *out++ = 0;
+      filter->last_was_overflow = TRUE;
+    } else {
+      *out++ = (guint8) (pulse / 8);
+      filter->last_was_overflow = FALSE;
+    }
+  } else {
+    while (pulse >= OVERFLOW_HI) {
+      *out++ = 0;
+      GST_WRITE_UINT24_LE (out, OVERFLOW_HI);
+      out += 3;
+      pulse -= OVERFLOW_HI;
+    }
+    if (pulse >= OVERFLOW_LO) {
+      *out++ = 0;
+      GST_WRITE_UINT24_LE (out, pulse);
+      out += 3;
+    } else
+      *out++ = (guint8) (pulse / 8);
+  }
+  return out;
+}
+
+static void
+gst_tapfileenc_pack (GstTapFileEnc * filter, const guint32 * data,
+    guint len, guint8 * out)
+{
+  guint i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128 ();
+
+  for (; i + 8 <= len; i += 8) {
+    __m128i lo = _mm_loadu_si128 ((const __m128i *) (data + i));
+    __m128i hi = _mm_loadu_si128 ((const __m128i *) (data + i + 4));
+
+    if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (_mm_srli_epi32 (_mm_or_si128 (lo,
+                        hi), 11), zero)) == 0xFFFF) {
+      /* all 8 are below OVERFLOW_LO: after dividing by 8 they fit in a
+       * byte, so saturating packs do not change them */
+      __m128i words = _mm_packs_epi32 (_mm_srli_epi32 (lo, 3),
+          _mm_srli_epi32 (hi, 3));
+      _mm_storel_epi64 ((__m128i *) out, _mm_packus_epi16 (words, zero));
+      out += 8;
+      /* in version 0, a short pulse always clears this */
+      if (filter->version == 0)
+        filter->last_was_overflow = FALSE;
+    } else {
+      guint j;
+      for (j = i; j < i + 8; j++)
+        out = gst_tapfileenc_pack_pulse (filter, data[j], out);
+    }
+  }
+#endif
+  for (; i < len; i++)
+    out = gst_tapfileenc_pack_pulse (filter, data[i], out);
+}
+
+/* Detection of machine and video type */
+
+static gboolean
+gst_tapfileenc_is_auto (GstTapFileEnc * filter)
+{
+  return filter->machine_setting == TAP_MACHINE_AUTO
+      || filter->video_setting == TAP_VIDEOTYPE_AUTO;
+}
+
+static void
+gst_tapfileenc_update_template (GstTapFileEnc * filter)
+{
+  GstPadTemplate *templ =
+      gst_static_pad_template_get (gst_tapfileenc_is_auto (filter) ?
+      &sink_factory : &sink_clock_factory);
+
+  gst_object_ref_sink (templ);
+  g_object_set (filter->sinkpad, "template", templ, NULL);
+  gst_object_unref (templ);
+}
+
+/* how close the pulses are to the ones the ROM saver writes on machine
+ * with video type video. Only pulses within the tolerance count, and the
+ * closer, the more */
+static guint64
+gst_tapfileenc_detect_score (GstTapFileEnc * filter, guint machine,
+    guint video)
+{
+  const guint32 *data = (const guint32 *) filter->prefix->data;
+  guint len = filter->prefix->len;
+  guint64 score = 0;
+  guint i, k;
+
+  for (k = 0; k < G_N_ELEMENTS (tap_rom_pulses[machine]); k++) {
+    guint64 expected = gst_util_uint64_scale_round (tap_rom_pulses[machine][k],
+        filter->rate, tap_clocks[machine][video]);
+
+    if (filter->halfwaves)
+      expected /= 2;
+    if (expected == 0)
+      continue;
+    for (i = 0; i < len; i++) {
+      guint64 deviation = data[i] > expected ? data[i] - expected
+          : expected - data[i];
 
+      deviation = deviation * 1000 / expected;
+      if (deviation < TAPFILEENC_DETECT_TOLERANCE)
+        score += TAPFILEENC_DETECT_TOLERANCE - deviation;
+    }
+  }
+
+  return score;
+}
+
+static void
+gst_tapfileenc_detect (GstTapFileEnc * filter)
+{
+  guint machine, video;
+  guint64 best_score = 0;
+
+  filter->machine_byte = filter->machine_setting == TAP_MACHINE_AUTO ?
+      TAP_MACHINE_C64 : filter->machine_setting;
+  filter->video_byte = filter->video_setting == TAP_VIDEOTYPE_AUTO ?
+      TAP_VIDEOTYPE_PAL : filter->video_setting;
+
+  for (machine = 0; machine <= TAP_MACHINE_MAX; machine++) {
+    if (filter->machine_setting != TAP_MACHINE_AUTO
+        && filter->machine_setting != machine)
+      continue;
+    /* VIC-20 and C64 PAL ROM tapes cannot be told apart */
+    if (filter->machine_setting == TAP_MACHINE_AUTO
+        && machine == TAP_MACHINE_VIC)
+      continue;
+    for (video = 0; video <= TAP_VIDEOTYPE_MAX; video++) {
+      guint64 score;
+
+      if (filter->video_setting != TAP_VIDEOTYPE_AUTO
+          && filter->video_setting != video)
+        continue;
+      score = gst_tapfileenc_detect_score (filter, machine, video);
+      GST_DEBUG_OBJECT (filter, "machine %u video %u: score %"
+          G_GUINT64_FORMAT, machine, video, score);
+      /* on a tie, the first one wins */
+      if (score > best_score) {
+        best_score = score;
+        filter->machine_byte = machine;
+        filter->video_byte = video;
+      }
+    }
+  }
+
+  if (best_score == 0 && filter->prefix->len > 0)
+    GST_ELEMENT_WARNING (filter, STREAM, ENCODE, (NULL),
+        ("no ROM loader pulses found, assuming machine %u video type %u",
+            filter->machine_byte, filter->video_byte));
+  else
+    GST_INFO_OBJECT (filter, "detected machine %u video type %u",
+        filter->machine_byte, filter->video_byte);
+  filter->detecting = FALSE;
+}
+
+/* scales pulses from the input rate to the clock of the machine, carrying
+ * the rounding error from one pulse to the next */
+static const guint32 *
+gst_tapfileenc_scale (GstTapFileEnc * filter, const guint32 * data,
+    guint len)
+{
+  guint clock = tap_clocks[filter->machine_byte][filter->video_byte];
+  guint32 *out;
+  guint i;
+
+  if ((guint) filter->rate == clock)
+    return data;
+
+  g_array_set_size (filter->scaled, len);
+  out = (guint32 *) filter->scaled->data;
+  for (i = 0; i < len; i++) {
+    guint64 scaled = (guint64) data[i] * clock + filter->scale_error;
+
+    out[i] = (guint32) MIN (scaled / filter->rate, G_MAXUINT32);
+    filter->scale_error = scaled % filter->rate;
+  }
+
+  return out;
+}
+
+/* Output to sinks which cannot seek */
+
+static gboolean
+gst_tapfileenc_downstream_is_seekable (GstTapFileEnc * filter)
+{
+  GstQuery *query = gst_query_new_seeking (GST_FORMAT_BYTES);
+  gboolean seekable = TRUE;
+
+  /* if downstream does not answer, assume it can seek, as before */
+  if (gst_pad_peer_query (filter->srcpad, query))
+    gst_query_parse_seeking (query, NULL, &seekable, NULL, NULL);
+  gst_query_unref (query);
+
+  return seekable;
+}
+
+static gboolean
+gst_tapfileenc_open_spool (GstTapFileEnc * filter)
+{
+  GError *error = NULL;
+  gint fd = g_file_open_tmp ("gsttapfileenc-XXXXXX", &filter->spool_path,
+      &error);
+
+  if (fd < 0) {
+    GST_ELEMENT_ERROR (filter, RESOURCE, OPEN_WRITE, (NULL),
+        ("cannot create temporary file: %s", error->message));
+    g_error_free (error);
+    return FALSE;
+  }
+  filter->spool = fdopen (fd, "wb");
+  if (filter->spool == NULL) {
+    g_close (fd, NULL);
+    GST_ELEMENT_ERROR (filter, RESOURCE, OPEN_WRITE, (NULL),
+        ("cannot open temporary file %s", filter->spool_path));
+    gst_tapfileenc_close_spool (filter);
+    return FALSE;
+  }
+  GST_DEBUG_OBJECT (filter, "downstream cannot seek, keeping output in %s",
+      filter->spool_path);
+  return TRUE;
+}
+
+/* chooses how to output, and pushes the header if it goes first */
 static GstFlowReturn
-gst_tapfileenc_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+gst_tapfileenc_start_output (GstTapFileEnc * filter)
+{
+  guint length = 0;
+
+  filter->output = output_seekable;
+  if (!gst_tapfileenc_downstream_is_seekable (filter)) {
+    if (filter->length_hint > 0) {
+      filter->output = output_length_hint;
+      length = filter->length_hint;
+    } else {
+      filter->output = output_spool;
+      return gst_tapfileenc_open_spool (filter) ? GST_FLOW_OK : GST_FLOW_ERROR;
+    }
+  }
+
+  /* with a seekable sink, the real length will be written later */
+  return write_header (filter->srcpad, filter->version, filter->machine_byte,
+      filter->video_byte, length);
+}
+
+static GstFlowReturn
+gst_tapfileenc_output (GstTapFileEnc * filter, GstBuffer * buf)
 {
-  GstTapFileEnc *filter = GST_TAPFILEENC (parent);
   GstMapInfo map;
-  guint *data;
-  guint buflen = gst_buffer_get_size (buf) / sizeof (guint32);
-  guint bufsofar;
+  gboolean written;
+
+  if (filter->output != output_spool)
+    return gst_pad_push (filter->srcpad, buf);
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  written = fwrite (map.data, 1, map.size, filter->spool) == map.size;
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+  if (!written) {
+    GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, (NULL),
+        ("cannot write to temporary file %s", filter->spool_path));
+    return GST_FLOW_ERROR;
+  }
+  return GST_FLOW_OK;
+}
+
+/* at EOS, pushes the header and then the whole temporary file, mapped in
+ * memory */
+static GstFlowReturn
+gst_tapfileenc_flush_spool (GstTapFileEnc * filter)
+{
+  GstFlowReturn ret;
+  GMappedFile *mapped;
+  GError *error = NULL;
+
+  if (fclose (filter->spool) != 0) {
+    filter->spool = NULL;
+    GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, (NULL),
+        ("cannot write to temporary file %s", filter->spool_path));
+    gst_tapfileenc_close_spool (filter);
+    return GST_FLOW_ERROR;
+  }
+  filter->spool = NULL;
+
+  ret = write_header (filter->srcpad, filter->version, filter->machine_byte,
+      filter->video_byte, filter->length);
+  if (ret == GST_FLOW_OK && filter->length > 0) {
+    mapped = g_mapped_file_new (filter->spool_path, FALSE, &error);
+    if (mapped == NULL) {
+      GST_ELEMENT_ERROR (filter, RESOURCE, READ, (NULL),
+          ("cannot read temporary file %s: %s", filter->spool_path,
+              error->message));
+      g_error_free (error);
+      ret = GST_FLOW_ERROR;
+    } else
+      ret = gst_pad_push (filter->srcpad,
+          gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+              g_mapped_file_get_contents (mapped),
+              g_mapped_file_get_length (mapped), 0,
+              g_mapped_file_get_length (mapped), mapped,
+              (GDestroyNotify) g_mapped_file_unref));
+  }
+  gst_tapfileenc_close_spool (filter);
+
+  return ret;
+}
+
+/* Checkpoints */
+
+/* a buffer pushed is not necessarily written yet, if there is a queue
+ * before the sink. A drain query comes back only when all that was pushed
+ * before it has been handled */
+static gboolean
+gst_tapfileenc_output_written (GstTapFileEnc * filter)
+{
+#if GST_CHECK_VERSION(1,2,0)
+  GstQuery *query = gst_query_new_drain ();
+  gboolean written = gst_pad_peer_query (filter->srcpad, query);
+
+  gst_query_unref (query);
+  if (!written)
+    GST_DEBUG_OBJECT (filter, "downstream did not answer the drain query");
+
+  return written;
+#else
+  return FALSE;
+#endif
+}
+
+static void
+gst_tapfileenc_save_checkpoint (GstTapFileEnc * filter)
+{
+  GKeyFile *checkpoint;
+  GError *error = NULL;
+
+  if (!gst_tapfileenc_output_written (filter)) {
+    GST_DEBUG_OBJECT (filter, "output not known to be written, no checkpoint");
+    filter->last_checkpoint = g_get_monotonic_time ();
+    return;
+  }
+
+  checkpoint = g_key_file_new ();
+
+  g_key_file_set_uint64 (checkpoint, "tapfileenc", "length", filter->length);
+  g_key_file_set_integer (checkpoint, "tapfileenc", "version",
+      filter->version);
+  g_key_file_set_integer (checkpoint, "tapfileenc", "machine",
+      filter->machine_byte);
+  g_key_file_set_integer (checkpoint, "tapfileenc", "video",
+      filter->video_byte);
+  g_key_file_set_boolean (checkpoint, "tapfileenc", "last-was-overflow",
+      filter->last_was_overflow);
+  g_key_file_set_uint64 (checkpoint, "tapfileenc", "output-offset",
+      TAP_HEADER_SIZE + filter->length);
+  if (filter->input_offset != GST_BUFFER_OFFSET_NONE)
+    g_key_file_set_uint64 (checkpoint, "tapenc", "input-offset",
+        filter->input_offset);
+
+  /* g_key_file_save_to_file replaces the file atomically */
+  if (!g_key_file_save_to_file (checkpoint, filter->checkpoint_file, &error)) {
+    GST_WARNING_OBJECT (filter, "cannot save checkpoint %s: %s",
+        filter->checkpoint_file, error->message);
+    g_error_free (error);
+  }
+  g_key_file_free (checkpoint);
+  filter->last_checkpoint = g_get_monotonic_time ();
+}
+
+/* restores the state saved in checkpoint-file, and tells downstream to
+ * write after the part already written */
+static GstFlowReturn
+gst_tapfileenc_resume (GstTapFileEnc * filter)
+{
+  GKeyFile *checkpoint = g_key_file_new ();
+  GError *error = NULL;
+  GstSegment segment;
   GstFlowReturn ret = GST_FLOW_OK;
-  GstByteWriter *writer = gst_byte_writer_new ();
-  guint size;
+
+  if (!g_key_file_load_from_file (checkpoint, filter->checkpoint_file,
+          G_KEY_FILE_NONE, &error)) {
+    GST_ELEMENT_ERROR (filter, RESOURCE, READ, (NULL),
+        ("cannot load checkpoint %s: %s", filter->checkpoint_file,
+            error->message));
+    g_error_free (error);
+    ret = GST_FLOW_ERROR;
+  } else if (g_key_file_get_integer (checkpoint, "tapfileenc", "version",
+          NULL) != filter->version) {
+    GST_ELEMENT_ERROR (filter, STREAM, FORMAT, (NULL),
+        ("checkpoint %s was saved for TAP version %d, not %d",
+            filter->checkpoint_file, g_key_file_get_integer (checkpoint,
+                "tapfileenc", "version", NULL), filter->version));
+    ret = GST_FLOW_ERROR;
+  } else {
+    filter->length = (guint) g_key_file_get_uint64 (checkpoint, "tapfileenc",
+        "length", NULL);
+    filter->last_was_overflow = g_key_file_get_boolean (checkpoint,
+        "tapfileenc", "last-was-overflow", NULL);
+    /* what was detected before is kept */
+    if (filter->machine_setting == TAP_MACHINE_AUTO
+        && g_key_file_has_key (checkpoint, "tapfileenc", "machine", NULL))
+      filter->machine_byte = (guchar) CLAMP (g_key_file_get_integer
+          (checkpoint, "tapfileenc", "machine", NULL), 0, TAP_MACHINE_MAX);
+    if (filter->video_setting == TAP_VIDEOTYPE_AUTO
+        && g_key_file_has_key (checkpoint, "tapfileenc", "video", NULL))
+      filter->video_byte = (guchar) CLAMP (g_key_file_get_integer
+          (checkpoint, "tapfileenc", "video", NULL), 0, TAP_VIDEOTYPE_MAX);
+    GST_DEBUG_OBJECT (filter, "resuming after %u bytes", filter->length);
+
+    gst_segment_init (&segment, GST_FORMAT_BYTES);
+    segment.start = segment.position = TAP_HEADER_SIZE + filter->length;
+    if (!gst_pad_push_event (filter->srcpad, gst_event_new_segment (&segment)))
+      ret = GST_FLOW_ERROR;
+  }
+  g_key_file_free (checkpoint);
+  filter->last_checkpoint = g_get_monotonic_time ();
+
+  return ret;
+}
+
+/* sends the header if not done yet, then encodes the pulses */
+static GstFlowReturn
+gst_tapfileenc_encode (GstTapFileEnc * filter, const guint32 * data,
+    guint len)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  gsize size;
+
+  if (!filter->sent_header && filter->resume
+      && filter->checkpoint_file != NULL) {
+    ret = gst_tapfileenc_resume (filter);
+    filter->sent_header = TRUE;
+    if (ret != GST_FLOW_OK)
+      return ret;
+  }
 
   if (!filter->sent_header) {
-    ret = write_header (filter->srcpad, filter->version, filter->machine_byte, filter->video_byte, 0    /* real length will be written later */
-        );
+    ret = gst_tapfileenc_start_output (filter);
 
+    if (ret == GST_FLOW_ERROR) {
+      filter->sent_header = TRUE;
+      return ret;
+    }
     if (ret != GST_FLOW_OK) {
       GST_WARNING_OBJECT (filter, "push header failed: flow = %s",
           gst_flow_get_name (ret));
@@ -333,43 +978,76 @@ gst_tapfileenc_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
     filter->sent_header = TRUE;
   }
 
-  gst_buffer_map (buf, &map, GST_MAP_READ);
-  data = (guint *) map.data;
-  for (bufsofar = 0; bufsofar < buflen; bufsofar++) {
-    guint pulse = data[bufsofar];
-    if (filter->version == 0) {
-      if (pulse >= OVERFLOW_LO && !filter->last_was_overflow) {
-        gst_byte_writer_put_uint8 (writer, 0);
-        filter->last_was_overflow = TRUE;
-      } else {
-        guint8 pulse8 = pulse / 8;
-        gst_byte_writer_put_uint8 (writer, pulse8);
-        filter->last_was_overflow = FALSE;
-      }
-    } else {
-      while (pulse >= OVERFLOW_HI) {
-        gst_byte_writer_put_uint8 (writer, 0);
-        gst_byte_writer_put_uint24_le (writer, OVERFLOW_HI);
-        pulse -= OVERFLOW_HI;
-      }
-      if (pulse >= OVERFLOW_LO) {
-        gst_byte_writer_put_uint8 (writer, 0);
-        gst_byte_writer_put_uint24_le (writer, pulse);
-      } else {
-        guint8 pulse8 = pulse / 8;
-        gst_byte_writer_put_uint8 (writer, pulse8);
-      }
-    }
-  }
-  gst_buffer_unmap (buf, &map);
-
-  size = gst_byte_writer_get_size (writer);
+  data = gst_tapfileenc_scale (filter, data, len);
+  size = gst_tapfileenc_packed_size (filter, data, len);
   if (size > 0) {
-    GstBuffer *newbuf = gst_byte_writer_free_and_get_buffer (writer);
-    ret = gst_pad_push (filter->srcpad, newbuf);
+    GstBuffer *newbuf = gst_buffer_new_allocate (NULL, size, NULL);
+    GstMapInfo outmap;
+
+    gst_buffer_map (newbuf, &outmap, GST_MAP_WRITE);
+    gst_tapfileenc_pack (filter, data, len, outmap.data);
+    gst_buffer_unmap (newbuf, &outmap);
+    ret = gst_tapfileenc_output (filter, newbuf);
     filter->length += size;
+  }
+
+  return ret;
+}
+
+/* encodes the pulses held back for detection */
+static GstFlowReturn
+gst_tapfileenc_end_detection (GstTapFileEnc * filter)
+{
+  GstFlowReturn ret;
+
+  gst_tapfileenc_detect (filter);
+  ret = gst_tapfileenc_encode (filter,
+      (const guint32 *) filter->prefix->data, filter->prefix->len);
+  g_array_set_size (filter->prefix, 0);
+
+  return ret;
+}
+
+/* chain function
+ * this function does the actual processing
+ */
+
+static GstFlowReturn
+gst_tapfileenc_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  GstTapFileEnc *filter = GST_TAPFILEENC (parent);
+  GstMapInfo map;
+  guint buflen = gst_buffer_get_size (buf) / sizeof (guint32);
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  if (filter->rate == 0) {
+    GST_ELEMENT_ERROR (filter, CORE, NEGOTIATION, (NULL),
+        ("no caps before data"));
+    gst_buffer_unref (buf);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  if (filter->detecting) {
+    g_array_append_vals (filter->prefix, map.data, buflen);
+    if (filter->prefix->len >= TAPFILEENC_DETECT_PULSES)
+      ret = gst_tapfileenc_end_detection (filter);
   } else
-    gst_byte_writer_free (writer);
+    ret = gst_tapfileenc_encode (filter, (const guint32 *) map.data, buflen);
+  gst_buffer_unmap (buf, &map);
+
+  /* pulses held back are not in the output yet, and neither is anything
+   * while the output goes to the temporary file */
+  if (ret == GST_FLOW_OK && !filter->detecting
+      && GST_BUFFER_OFFSET_END_IS_VALID (buf))
+    filter->input_offset = GST_BUFFER_OFFSET_END (buf);
+  gst_buffer_unref (buf);
+
+  if (ret == GST_FLOW_OK && filter->checkpoint_file != NULL
+      && !filter->detecting && filter->output != output_spool
+      && g_get_monotonic_time () - filter->last_checkpoint >=
+      (gint64) filter->checkpoint_interval * G_USEC_PER_SEC)
+    gst_tapfileenc_save_checkpoint (filter);
 
   return ret;
 }
@@ -386,13 +1064,27 @@ gst_tapfileenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
 
   switch (GST_EVENT_TYPE (event)) {
     case GST_EVENT_EOS:
-      /* seek to beginning of file */
-      gst_segment_init (&segment, GST_FORMAT_BYTES);
-      if (!gst_pad_push_event (filter->srcpad,
-              gst_event_new_segment (&segment)))
-        return FALSE;
-      write_header (filter->srcpad, filter->version, filter->machine_byte,
-          filter->video_byte, filter->length);
+      if (filter->detecting && filter->prefix->len > 0)
+        gst_tapfileenc_end_detection (filter);
+      if (filter->output == output_spool) {
+        if (filter->spool != NULL)
+          gst_tapfileenc_flush_spool (filter);
+      } else if (filter->output == output_length_hint) {
+        if (filter->length != filter->length_hint)
+          GST_ELEMENT_WARNING (filter, STREAM, ENCODE, (NULL),
+              ("length-hint was %u, but the length is %u: the header is wrong",
+                  filter->length_hint, filter->length));
+      } else {
+        /* seek to beginning of file */
+        gst_segment_init (&segment, GST_FORMAT_BYTES);
+        if (!gst_pad_push_event (filter->srcpad,
+                gst_event_new_segment (&segment)))
+          return FALSE;
+        write_header (filter->srcpad, filter->version, filter->machine_byte,
+            filter->video_byte, filter->length);
+      }
+      if (filter->checkpoint_file != NULL)
+        gst_tapfileenc_save_checkpoint (filter);
       break;
     case GST_EVENT_CAPS:
       gst_event_parse_caps (event, &caps);
@@ -400,8 +1092,8 @@ gst_tapfileenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
       if (!gst_structure_get_int (structure, "rate", &samplerate)) {
         GST_ERROR_OBJECT (filter, "input caps have no sample rate field");
         return FALSE;
-      } else if (samplerate !=
-          tap_clocks[filter->machine_byte][filter->video_byte]) {
+      } else if (!gst_tapfileenc_is_auto (filter) && samplerate !=
+          tap_clocks[filter->machine_setting][filter->video_setting]) {
         GST_ERROR_OBJECT (filter, "wrong sample rate");
         return FALSE;
       } else if (!gst_structure_get_boolean (structure, "halfwaves",
@@ -413,6 +1105,14 @@ gst_tapfileenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
       else
         filter->version = filter->force_version_0 ? 0 : 1;
 
+      filter->rate = samplerate;
+      filter->halfwaves = halfwaves;
+      filter->scale_error = 0;
+      if (!gst_tapfileenc_is_auto (filter)) {
+        filter->machine_byte = filter->machine_setting;
+        filter->video_byte = filter->video_setting;
+      } else if (!filter->sent_header)
+        filter->detecting = TRUE;
       break;
     default:
       break;
@@ -435,10 +1135,13 @@ gsttapfileenc_query (GstPad * pad, GstObject * parent, GstQuery * query)
       GstStructure *structure = gst_caps_get_structure (ret, 0);
       GValue value = { 0 };
 
-      g_value_init (&value, G_TYPE_INT);
-      g_value_set_int (&value,
-          tap_clocks[filter->machine_byte][filter->video_byte]);
-      gst_structure_set_value (structure, "rate", &value);
+      /* when detecting, any rate will be scaled */
+      if (!gst_tapfileenc_is_auto (filter)) {
+        g_value_init (&value, G_TYPE_INT);
+        g_value_set_int (&value,
+            tap_clocks[filter->machine_setting][filter->video_setting]);
+        gst_structure_set_value (structure, "rate", &value);
+      }
       gst_query_set_caps_result (query, ret);
       res = TRUE;
 
@@ -460,7 +1163,8 @@ gsttapfileenc_query (GstPad * pad, GstObject * parent, GstQuery * query)
 static void
 gst_tapfileenc_init (GstTapFileEnc * filter)
 {
-  filter->sinkpad = gst_pad_new_from_static_template (&sink_factory, "sink");
+  filter->sinkpad =
+      gst_pad_new_from_static_template (&sink_clock_factory, "sink");
   gst_pad_set_chain_function (filter->sinkpad,
       GST_DEBUG_FUNCPTR (gst_tapfileenc_chain));
   gst_pad_set_event_function (filter->sinkpad,
@@ -473,6 +1177,9 @@ gst_tapfileenc_init (GstTapFileEnc * filter)
   gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
   filter->sent_header = FALSE;
   filter->length = 0;
+  filter->input_offset = GST_BUFFER_OFFSET_NONE;
+  filter->prefix = g_array_new (FALSE, FALSE, sizeof (guint32));
+  filter->scaled = g_array_new (FALSE, FALSE, sizeof (guint32));
 }
 
 gboolean
@@ -54,18 +54,34 @@
 #include <string.h>
 
 #include "gstdmpdec.h"
+#include "gstdmpenc.h"
 #include "gsttapfileenc.h"
 #include "gsttapfiledec.h"
 #include "gsttapconvert.h"
+#ifdef HAVE_GST_AGGREGATOR
+#include "gsttapconsensus.h"
+#endif
+#ifdef HAVE_ZLIB
+#include "gstcswdec.h"
+#include "gstcswenc.h"
+#endif
 
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
   return
     gst_dmpdec_register (plugin)
+ && gst_dmpenc_register (plugin)
  && gst_tapfileenc_register (plugin)
  && gst_tapfiledec_register (plugin)
  && gst_tapconvert_register (plugin)
+#ifdef HAVE_GST_AGGREGATOR
+ && gst_tapconsensus_register (plugin)
+#endif
+#ifdef HAVE_ZLIB
+ && gst_cswdec_register (plugin)
+ && gst_cswenc_register (plugin)
+#endif
 ;
 }
 
@@ -0,0 +1,288 @@
+/*
+ * GStreamer
+ * Copyright (C) 2011 Fabrizio Gennari <fabrizio.ge@tiscali.it>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/* Checks of the arithmetic of tapconvert. The element is linked to two
+ * pads of the program, the pulses are pushed into one and collected from
+ * the other, and compared with what a plain 64-bit division gives, pulse
+ * by pulse or, with error diffusion, over the whole stream */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "gsttapconvert.h"
+
+typedef struct
+{
+  GstElement *element;
+  GstPad *srcpad;
+  GstPad *sinkpad;
+  GstCaps *outcaps;
+  GArray *output;
+  /* the output is only summed, not kept, if FALSE */
+  gboolean keep_output;
+  guint64 output_sum;
+} TapConvertCheck;
+
+static GstFlowReturn
+check_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+  TapConvertCheck *check = g_object_get_data (G_OBJECT (pad), "check");
+  GstMapInfo map;
+  guint i;
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  for (i = 0; i < map.size / sizeof (guint32); i++)
+    check->output_sum += ((const guint32 *) map.data)[i];
+  if (check->keep_output)
+    g_array_append_vals (check->output, map.data,
+        map.size / sizeof (guint32));
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+
+  return GST_FLOW_OK;
+}
+
+/* the output rate is chosen by answering the caps queries of tapconvert */
+static gboolean
+check_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  TapConvertCheck *check = g_object_get_data (G_OBJECT (pad), "check");
+  GstCaps *caps;
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CAPS:
+      gst_query_set_caps_result (query, check->outcaps);
+      return TRUE;
+    case GST_QUERY_ACCEPT_CAPS:
+      gst_query_parse_accept_caps (query, &caps);
+      gst_query_set_accept_caps_result (query,
+          gst_caps_can_intersect (caps, check->outcaps));
+      return TRUE;
+    default:
+      return gst_pad_query_default (pad, parent, query);
+  }
+}
+
+static void
+check_start (TapConvertCheck * check, gint inrate, gint outrate,
+    gboolean error_diffusion)
+{
+  GstCaps *incaps;
+  GstSegment segment;
+  GstPad *pad;
+
+  check->element = gst_element_factory_make ("tapconvert", NULL);
+  if (check->element == NULL)
+    g_error ("cannot create tapconvert");
+  g_object_set (check->element, "error-diffusion", error_diffusion, NULL);
+
+  check->outcaps = gst_caps_new_simple ("audio/x-tap",
+      "rate", G_TYPE_INT, outrate, "halfwaves", G_TYPE_BOOLEAN, FALSE, NULL);
+  check->output = g_array_new (FALSE, FALSE, sizeof (guint32));
+  check->keep_output = !error_diffusion;
+  check->output_sum = 0;
+
+  check->srcpad = gst_pad_new ("src", GST_PAD_SRC);
+  check->sinkpad = gst_pad_new ("sink", GST_PAD_SINK);
+  g_object_set_data (G_OBJECT (check->sinkpad), "check", check);
+  gst_pad_set_chain_function (check->sinkpad, check_chain);
+  gst_pad_set_query_function (check->sinkpad, check_query);
+  pad = gst_element_get_static_pad (check->element, "sink");
+  if (gst_pad_link (check->srcpad, pad) != GST_PAD_LINK_OK)
+    g_error ("cannot link to tapconvert");
+  gst_object_unref (pad);
+  pad = gst_element_get_static_pad (check->element, "src");
+  if (gst_pad_link (pad, check->sinkpad) != GST_PAD_LINK_OK)
+    g_error ("cannot link from tapconvert");
+  gst_object_unref (pad);
+  gst_pad_set_active (check->srcpad, TRUE);
+  gst_pad_set_active (check->sinkpad, TRUE);
+  if (gst_element_set_state (check->element, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_SUCCESS)
+    g_error ("cannot start tapconvert");
+
+  incaps = gst_caps_new_simple ("audio/x-tap",
+      "rate", G_TYPE_INT, inrate, "halfwaves", G_TYPE_BOOLEAN, FALSE, NULL);
+  gst_segment_init (&segment, GST_FORMAT_TIME);
+  gst_pad_push_event (check->srcpad,
+      gst_event_new_stream_start ("tapconvert-check"));
+  if (!gst_pad_push_event (check->srcpad, gst_event_new_caps (incaps)))
+    g_error ("tapconvert refused %d Hz to %d Hz", inrate, outrate);
+  gst_pad_push_event (check->srcpad, gst_event_new_segment (&segment));
+  gst_caps_unref (incaps);
+}
+
+static void
+check_push (TapConvertCheck * check, const guint32 * pulses, guint len)
+{
+  GstBuffer *buf = gst_buffer_new_allocate (NULL, len * sizeof (guint32),
+      NULL);
+  GstFlowReturn ret;
+
+  gst_buffer_fill (buf, 0, pulses, len * sizeof (guint32));
+  ret = gst_pad_push (check->srcpad, buf);
+  if (ret != GST_FLOW_OK)
+    g_error ("push failed: %s", gst_flow_get_name (ret));
+}
+
+static void
+check_stop (TapConvertCheck * check)
+{
+  GstPad *pad;
+
+  gst_pad_push_event (check->srcpad, gst_event_new_eos ());
+  gst_element_set_state (check->element, GST_STATE_NULL);
+  gst_pad_set_active (check->srcpad, FALSE);
+  gst_pad_set_active (check->sinkpad, FALSE);
+  pad = gst_element_get_static_pad (check->element, "sink");
+  gst_pad_unlink (check->srcpad, pad);
+  gst_object_unref (pad);
+  pad = gst_element_get_static_pad (check->element, "src");
+  gst_pad_unlink (pad, check->sinkpad);
+  gst_object_unref (pad);
+  gst_object_unref (check->srcpad);
+  gst_object_unref (check->sinkpad);
+  gst_object_unref (check->element);
+  gst_caps_unref (check->outcaps);
+  g_array_free (check->output, TRUE);
+}
+
+/* pulses which would not fit 32 bits at the output rate are left out */
+static void
+check_append (GArray * input, guint64 pulse, gint inrate, gint outrate)
+{
+  guint32 value = (guint32) pulse;
+
+  if (pulse <= G_MAXUINT32 && pulse * outrate / inrate <= G_MAXUINT32)
+    g_array_append_val (input, value);
+}
+
+/* without error diffusion, every pulse must be what the division by the
+ * input rate gives, including the pulses that make the numerator largest,
+ * and those on either side of a multiple of the input rate */
+static void
+check_division (gint inrate, gint outrate, GRand * rand)
+{
+  TapConvertCheck check;
+  GArray *input = g_array_new (FALSE, FALSE, sizeof (guint32));
+  guint64 largest;
+  guint i;
+
+  for (i = 0; i < 1024; i++)
+    check_append (input, i, inrate, outrate);
+  for (i = 1; i < 1024; i++) {
+    check_append (input, (guint64) inrate * i - 1, inrate, outrate);
+    check_append (input, (guint64) inrate * i, inrate, outrate);
+  }
+  /* the largest pulses that fit, whatever the rates */
+  largest = MIN ((guint64) G_MAXUINT32,
+      ((guint64) G_MAXUINT32 + 1) * inrate / outrate);
+  for (i = 0; i < 1024 && i < largest; i++) {
+    check_append (input, largest - i, inrate, outrate);
+    check_append (input, g_rand_int_range (rand, 0,
+            (gint32) MIN (largest, G_MAXINT32)), inrate, outrate);
+  }
+
+  check_start (&check, inrate, outrate, FALSE);
+  check_push (&check, (const guint32 *) input->data, input->len);
+  if (check.output->len != input->len)
+    g_error ("%d Hz to %d Hz: %u pulses became %u", inrate, outrate,
+        input->len, check.output->len);
+  for (i = 0; i < input->len; i++) {
+    guint64 expected =
+        (guint64) g_array_index (input, guint32, i) * outrate / inrate;
+
+    if (g_array_index (check.output, guint32, i) != expected)
+      g_error ("%d Hz to %d Hz: pulse %u became %u instead of %"
+          G_GUINT64_FORMAT, inrate, outrate, g_array_index (input, guint32,
+              i), g_array_index (check.output, guint32, i), expected);
+  }
+  check_stop (&check);
+  g_array_free (input, TRUE);
+}
+
+/* with error diffusion, nothing is lost however long the stream is: the
+ * output of an hour of pulses must be exactly as long as the input, at the
+ * output rate, rounded down */
+#define CHECK_STREAM_SECONDS 3600
+#define CHECK_STREAM_BUFFER 4096
+
+static void
+check_stream_length (gint inrate, gint outrate, GRand * rand)
+{
+  TapConvertCheck check;
+  guint32 pulses[CHECK_STREAM_BUFFER];
+  guint64 input_sum = 0;
+  guint64 expected;
+  guint i;
+
+  check_start (&check, inrate, outrate, TRUE);
+  while (input_sum < (guint64) CHECK_STREAM_SECONDS * inrate) {
+    /* about the lengths of the pulses of turbo loaders and ROM loaders */
+    for (i = 0; i < CHECK_STREAM_BUFFER; i++) {
+      pulses[i] = g_rand_int_range (rand, inrate / 6000 + 1,
+          inrate / 1000 + 2);
+      input_sum += pulses[i];
+    }
+    check_push (&check, pulses, CHECK_STREAM_BUFFER);
+  }
+  expected = input_sum * outrate / inrate;
+  if (check.output_sum != expected)
+    g_error ("%d Hz to %d Hz: %" G_GUINT64_FORMAT " became %"
+        G_GUINT64_FORMAT " instead of %" G_GUINT64_FORMAT, inrate, outrate,
+        input_sum, check.output_sum, expected);
+  check_stop (&check);
+}
+
+int
+main (int argc, char *argv[])
+{
+  /* the input rates which make the divisor a power of 2, or one away from
+   * it, are where the shift of the magic constant changes */
+  static const gint rates[] = {
+    1, 3, 7, 8, 9, 44100, 48000, 65535, 65536, 65537, 96000, 192000,
+    262143, 262144, 262145, 886724, 894886, 985248, 1022727, 1048575,
+    1048576, 1048577, 1108405, 2000000
+  };
+  GRand *rand;
+  guint i, j;
+
+  gst_init (&argc, &argv);
+  if (!gst_tapconvert_register (NULL))
+    g_error ("cannot register tapconvert");
+  rand = g_rand_new_with_seed (1);
+
+  for (i = 0; i < G_N_ELEMENTS (rates); i++)
+    for (j = 0; j < G_N_ELEMENTS (rates); j++)
+      if (i != j)
+        check_division (rates[i], rates[j], rand);
+
+  check_stream_length (44100, 985248, rand);
+  check_stream_length (985248, 44100, rand);
+  check_stream_length (48000, 1022727, rand);
+  check_stream_length (1108405, 96000, rand);
+
+  g_rand_free (rand);
+
+  return 0;
+}
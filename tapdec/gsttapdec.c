@@ -58,6 +58,8 @@
 #  include <config.h>
 #endif
 
+#include <string.h>
+
 #include <gst/gst.h>
 #include <gst/audio/gstaudiodecoder.h>
 
@@ -80,6 +82,33 @@ GST_DEBUG_CATEGORY_STATIC (gst_tapdec_debug);
 typedef struct _GstTapDec GstTapDec;
 typedef struct _GstTapDecClass GstTapDecClass;
 
+/* samples rendered by the decoder before being packed into the output
+ * format */
+#define TAPDEC_SCRATCH_SIZE 4096
+
+/* converts 32-bit mono samples to the output format */
+typedef void (*GstTapDecPack) (const int32_t * in, gpointer out,
+    guint samples);
+
+/* Rendered pulses, so that runs of pulses of the same length (pilot tones,
+ * data bits) are copied instead of being synthesized again. The cache is
+ * direct-mapped on the pulse length, and emptied whenever volume, waveform,
+ * inverted or halfwaves change. In halfwaves mode consecutive pulses have
+ * opposite polarity, and are not cached */
+#define TAPDEC_CACHE_ENTRIES 64
+#define TAPDEC_CACHE_MAX_PULSE 2048
+
+/* samples rendered before a gap, fading to silence, and after it, fading
+ * in from silence */
+#define TAPDEC_GAP_RAMP 64
+
+typedef struct
+{
+  /* 0 if the entry is empty */
+  uint32_t pulse;
+  int32_t *samples;
+} GstTapDecCacheEntry;
+
 struct _GstTapDec
 {
   GstAudioDecoder element;
@@ -87,8 +116,42 @@ struct _GstTapDec
   gboolean inverted;
   guint volume;
   gint waveform;
+  guint buffer_size;
 
   struct tap_dec_t *tap;
+
+  /* output buffers, and how many samples each can hold */
+  GstBufferPool *pool;
+  guint pool_samples;
+
+  /* NULL if the output is 32-bit mono, which the decoder renders itself */
+  GstTapDecPack pack;
+  int32_t scratch[TAPDEC_SCRATCH_SIZE];
+
+  gboolean halfwaves;
+  gboolean use_cache;
+  GstTapDecCacheEntry cache[TAPDEC_CACHE_ENTRIES];
+  /* the pulse being copied from the cache, and how much of it is done */
+  const int32_t *cached;
+  guint cached_len;
+  guint cached_pos;
+  guint64 cache_hits;
+  guint64 cache_misses;
+
+  /* pulses this long or longer become gaps, 0 = never */
+  guint gap_threshold;
+  int32_t last_sample;
+  int32_t ramp[TAPDEC_GAP_RAMP];
+  /* samples faded in since the last gap, TAPDEC_GAP_RAMP when done */
+  guint faded_in;
+  /* total duration of the gaps so far, by which the timestamps of the
+   * output buffers are delayed */
+  GstClockTime gap_offset;
+  /* where the last output buffer ended */
+  GstClockTime next_ts;
+  /* a buffer went out since the last flush, and the segment before it:
+   * gap events can follow */
+  gboolean pushed;
 };
 
 struct _GstTapDecClass
@@ -102,6 +165,9 @@ enum
   PROP_VOLUME,
   PROP_TRIGGER_ON_RISING_EDGE,
   PROP_WAVEFORM,
+  PROP_BUFFER_SIZE,
+  PROP_STATS,
+  PROP_GAP_THRESHOLD,
   N_PROPERTIES
 };
 
@@ -138,10 +204,54 @@ static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
     GST_PAD_ALWAYS,
     GST_STATIC_CAPS ("audio/x-raw, "
-        "format=" GST_AUDIO_NE (S32) ", "
-        "channels = (int) 1," "layout = (string) interleaved")
+        "format = (string) { " GST_AUDIO_NE (S32) ", " GST_AUDIO_NE (S16) ", "
+        GST_AUDIO_NE (F32) ", U8 }, "
+        "channels = (int) [ 1, 2 ], " "layout = (string) interleaved")
     );
 
+/* packing functions, one per format and number of channels, so that the
+ * inner loops have no branches. In stereo, both channels are the same */
+
+#define TAPDEC_TO_S32(x) (x)
+#define TAPDEC_TO_S16(x) ((gint16) ((x) >> 16))
+#define TAPDEC_TO_U8(x) ((guint8) (((x) >> 24) + 128))
+#define TAPDEC_TO_F32(x) ((gfloat) (x) * (1.0f / 2147483648.0f))
+
+#define TAPDEC_PACK(name, type, channels, convert)                     \
+static void                                                            \
+gst_tapdec_pack_##name##_##channels (const int32_t * in, gpointer out, \
+    guint samples)                                                     \
+{                                                                      \
+  type *outdata = (type *) out;                                        \
+  guint i, c;                                                          \
+                                                                       \
+  for (i = 0; i < samples; i++) {                                      \
+    type value = convert (in[i]);                                      \
+                                                                       \
+    for (c = 0; c < channels; c++)                                     \
+      *outdata++ = value;                                              \
+  }                                                                    \
+}
+
+TAPDEC_PACK (s32, gint32, 2, TAPDEC_TO_S32)
+TAPDEC_PACK (s16, gint16, 1, TAPDEC_TO_S16)
+TAPDEC_PACK (s16, gint16, 2, TAPDEC_TO_S16)
+TAPDEC_PACK (f32, gfloat, 1, TAPDEC_TO_F32)
+TAPDEC_PACK (f32, gfloat, 2, TAPDEC_TO_F32)
+TAPDEC_PACK (u8, guint8, 1, TAPDEC_TO_U8)
+TAPDEC_PACK (u8, guint8, 2, TAPDEC_TO_U8)
+
+static const struct
+{
+  GstAudioFormat format;
+  GstTapDecPack pack[2];
+} tapdec_packers[] = {
+  {GST_AUDIO_FORMAT_S32, {NULL, gst_tapdec_pack_s32_2}},
+  {GST_AUDIO_FORMAT_S16, {gst_tapdec_pack_s16_1, gst_tapdec_pack_s16_2}},
+  {GST_AUDIO_FORMAT_F32, {gst_tapdec_pack_f32_1, gst_tapdec_pack_f32_2}},
+  {GST_AUDIO_FORMAT_U8, {gst_tapdec_pack_u8_1, gst_tapdec_pack_u8_2}}
+};
+
 G_DEFINE_TYPE (GstTapDec, gst_tapdec, GST_TYPE_AUDIO_DECODER);
 
 /* GObject vmethod implementations */
@@ -162,6 +272,12 @@ gst_tapdec_set_property (GObject * object, guint prop_id,
     case PROP_WAVEFORM:
       filter->waveform = g_value_get_enum (value);
       break;
+    case PROP_BUFFER_SIZE:
+      filter->buffer_size = g_value_get_uint (value);
+      break;
+    case PROP_GAP_THRESHOLD:
+      filter->gap_threshold = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -184,12 +300,43 @@ gst_tapdec_get_property (GObject * object, guint prop_id,
     case PROP_WAVEFORM:
       g_value_set_enum (value, filter->waveform);
       break;
+    case PROP_BUFFER_SIZE:
+      g_value_set_uint (value, filter->buffer_size);
+      break;
+    case PROP_GAP_THRESHOLD:
+      g_value_set_uint (value, filter->gap_threshold);
+      break;
+    case PROP_STATS:{
+      guint64 hits = filter->cache_hits;
+      guint64 misses = filter->cache_misses;
+
+      g_value_take_boxed (value, gst_structure_new ("GstTapDecStats",
+              "cache-hits", G_TYPE_UINT64, hits,
+              "cache-misses", G_TYPE_UINT64, misses,
+              "cache-hit-rate", G_TYPE_DOUBLE,
+              hits + misses > 0 ? (gdouble) hits / (hits + misses) : 0.0,
+              NULL));
+      break;
+    }
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
   }
 }
 
+static void
+gst_tapdec_clear_cache (GstTapDec * filter)
+{
+  guint i;
+
+  for (i = 0; i < TAPDEC_CACHE_ENTRIES; i++) {
+    g_free (filter->cache[i].samples);
+    filter->cache[i].samples = NULL;
+    filter->cache[i].pulse = 0;
+  }
+  filter->cached = NULL;
+}
+
 /* GstAudioDecoder vmethod implementations */
 
 static gboolean
@@ -198,6 +345,13 @@ gst_tapdec_start (GstAudioDecoder * parent)
   GstTapDec *filter = gst_tapdec (parent);
   filter->tap = tapdec_init2 (filter->volume,
       filter->inverted, filter->waveform);
+  gst_tapdec_clear_cache (filter);
+  filter->cache_hits = filter->cache_misses = 0;
+  filter->last_sample = 0;
+  filter->faded_in = TAPDEC_GAP_RAMP;
+  filter->gap_offset = 0;
+  filter->next_ts = GST_CLOCK_TIME_NONE;
+  filter->pushed = FALSE;
   gst_audio_decoder_set_estimate_rate (parent, TRUE);
   return TRUE;
 }
@@ -206,9 +360,11 @@ static gboolean
 gst_tapdec_set_format (GstAudioDecoder * parent, GstCaps * caps)
 {
   GstTapDec *filter = gst_tapdec (parent);
-  GstCaps *out_caps;
+  GstCaps *templ_caps, *out_caps;
   GstAudioInfo info;
-  gboolean ret;
+  GstAudioFormat format;
+  gint channels;
+  guint i;
   gboolean halfwaves;
   GstStructure *structure;
   const GValue *rate;
@@ -228,13 +384,49 @@ gst_tapdec_set_format (GstAudioDecoder * parent, GstCaps * caps)
       g_value_get_int (rate), halfwaves ? "half" : "full");
 
   tapdec_enable_halfwaves (filter->tap, halfwaves);
-  out_caps =
+  gst_tapdec_clear_cache (filter);
+  filter->halfwaves = halfwaves;
+  filter->use_cache = !halfwaves;
+
+  /* the format and the number of channels downstream prefers, mono if it
+   * does not care */
+  templ_caps =
       gst_caps_make_writable (gst_static_pad_template_get_caps (&src_factory));
-  gst_caps_set_value (out_caps, "rate", rate);
-  ret = gst_audio_info_from_caps (&info, out_caps);
+  gst_caps_set_value (templ_caps, "rate", rate);
+  out_caps =
+      gst_pad_peer_query_caps (GST_AUDIO_DECODER_SRC_PAD (parent), templ_caps);
+  gst_caps_unref (templ_caps);
+  if (gst_caps_is_empty (out_caps)) {
+    GST_ERROR_OBJECT (filter, "downstream accepts no output format");
+    gst_caps_unref (out_caps);
+    return FALSE;
+  }
+  out_caps = gst_caps_make_writable (gst_caps_truncate (out_caps));
+  gst_structure_fixate_field_nearest_int (gst_caps_get_structure (out_caps,
+          0), "channels", 1);
+  out_caps = gst_caps_fixate (out_caps);
+  structure = gst_caps_get_structure (out_caps, 0);
+  format =
+      gst_audio_format_from_string (gst_structure_get_string (structure,
+          "format"));
+  if (!gst_structure_get_int (structure, "channels", &channels))
+    channels = 1;
   gst_caps_unref (out_caps);
-  if (!ret)
+
+  for (i = 0; i < G_N_ELEMENTS (tapdec_packers); i++)
+    if (tapdec_packers[i].format == format)
+      break;
+  if (i == G_N_ELEMENTS (tapdec_packers) || channels < 1 || channels > 2) {
+    GST_ERROR_OBJECT (filter, "unsupported output format");
     return FALSE;
+  }
+  filter->pack = tapdec_packers[i].pack[channels - 1];
+  GST_DEBUG_OBJECT (filter, "output %s, %d channels",
+      gst_audio_format_to_string (format), channels);
+
+  gst_audio_info_init (&info);
+  gst_audio_info_set_format (&info, format, g_value_get_int (rate), channels,
+      NULL);
   gst_audio_decoder_set_output_format (parent, &info);
   return TRUE;
 }
@@ -251,12 +443,64 @@ gst_tapdec_parse (GstAudioDecoder * dec,
   return GST_FLOW_OK;
 }
 
+static void
+gst_tapdec_set_pool (GstTapDec * filter, GstBufferPool * pool)
+{
+  if (filter->pool) {
+    gst_buffer_pool_set_active (filter->pool, FALSE);
+    gst_object_unref (filter->pool);
+  }
+  filter->pool = pool;
+}
+
 static gboolean
 gst_tapdec_stop (GstAudioDecoder * dec)
 {
   GstTapDec *filter = gst_tapdec (dec);
   tapdec_exit (filter->tap);
   filter->tap = NULL;
+  gst_tapdec_set_pool (filter, NULL);
+  gst_tapdec_clear_cache (filter);
+  return TRUE;
+}
+
+/* output buffers come from a pool of buffer-size samples, using the
+ * allocator negotiated with downstream */
+static gboolean
+gst_tapdec_decide_allocation (GstAudioDecoder * dec, GstQuery * query)
+{
+  GstTapDec *filter = gst_tapdec (dec);
+  GstAudioInfo *info = gst_audio_decoder_get_audio_info (dec);
+  GstBufferPool *pool;
+  GstAllocator *allocator = NULL;
+  GstAllocationParams params;
+  GstStructure *config;
+  GstCaps *caps;
+
+  if (!GST_AUDIO_DECODER_CLASS (gst_tapdec_parent_class)->decide_allocation
+      (dec, query))
+    return FALSE;
+
+  gst_query_parse_allocation (query, &caps, NULL);
+  gst_audio_decoder_get_allocator (dec, &allocator, &params);
+
+  pool = gst_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (pool);
+  gst_buffer_pool_config_set_params (config, caps,
+      filter->buffer_size * GST_AUDIO_INFO_BPF (info), 0, 0);
+  gst_buffer_pool_config_set_allocator (config, allocator, &params);
+  if (allocator)
+    gst_object_unref (allocator);
+  if (!gst_buffer_pool_set_config (pool, config)
+      || !gst_buffer_pool_set_active (pool, TRUE)) {
+    GST_ERROR_OBJECT (filter, "cannot set up the buffer pool");
+    gst_object_unref (pool);
+    return FALSE;
+  }
+
+  gst_tapdec_set_pool (filter, pool);
+  filter->pool_samples = filter->buffer_size;
+
   return TRUE;
 }
 
@@ -269,21 +513,267 @@ static GParamSpec *obj_properties[N_PROPERTIES] = { NULL, };
  * this function does the actual processing
  */
 
-#define TAPDEC_OUTBUF_SIZE 1024
+/* the samples before a gap have to be pushed before it, which takes
+ * subframes */
+static inline gboolean
+gst_tapdec_is_gap (GstTapDec * filter, uint32_t pulse)
+{
+#if GST_CHECK_VERSION(1,16,0)
+  return filter->gap_threshold > 0 && pulse >= filter->gap_threshold;
+#else
+  return FALSE;
+#endif
+}
 
+static inline guint
+gst_tapdec_ramp_length (uint32_t pulse)
+{
+  return MIN (TAPDEC_GAP_RAMP, pulse / 2);
+}
+
+/* starts a new pulse: from the cache if it is there, otherwise the decoder
+ * renders it, into the cache if it is short enough. Of a pulse which
+ * becomes a gap, only the ramp is rendered here. In halfwaves mode, the
+ * decoder still has to go past it, or all the following half waves would
+ * have the wrong polarity: a half wave of one sample is rendered instead,
+ * and thrown away */
+static void
+gst_tapdec_next_pulse (GstTapDec * filter, uint32_t pulse)
+{
+  GstTapDecCacheEntry *entry;
+  guint done = 0;
+  uint32_t nsamples;
+
+  if (gst_tapdec_is_gap (filter, pulse)) {
+    guint len = gst_tapdec_ramp_length (pulse);
+
+    if (filter->halfwaves) {
+      int32_t discarded;
+
+      tapdec_set_pulse (filter->tap, 1);
+      while (tapdec_get_buffer (filter->tap, &discarded, 1) > 0);
+    }
+    for (done = 0; done < len; done++)
+      filter->ramp[done] =
+          (int32_t) ((gint64) filter->last_sample * (len - 1 - done) / len);
+    filter->cached = filter->ramp;
+    filter->cached_len = len;
+    filter->cached_pos = 0;
+    filter->faded_in = 0;
+    return;
+  }
+
+  if (!filter->use_cache || pulse == 0 || pulse > TAPDEC_CACHE_MAX_PULSE) {
+    tapdec_set_pulse (filter->tap, pulse);
+    return;
+  }
+
+  entry = &filter->cache[pulse % TAPDEC_CACHE_ENTRIES];
+  if (entry->pulse == pulse) {
+    filter->cache_hits++;
+    filter->cached_len = pulse;
+  } else {
+    filter->cache_misses++;
+    entry->samples = g_renew (int32_t, entry->samples, pulse);
+    tapdec_set_pulse (filter->tap, pulse);
+    while (done < pulse && (nsamples = tapdec_get_buffer (filter->tap,
+                entry->samples + done, pulse - done)) > 0)
+      done += nsamples;
+    /* if the decoder gave fewer samples, use them once, do not keep them */
+    entry->pulse = done == pulse ? pulse : 0;
+    filter->cached_len = done;
+  }
+  filter->cached = entry->samples;
+  filter->cached_pos = 0;
+}
+
+/* the samples after a gap go from silence to their full level */
+static void
+gst_tapdec_fade_in (GstTapDec * filter, int32_t * out, guint len)
+{
+  guint i;
+
+  for (i = 0; i < len && filter->faded_in < TAPDEC_GAP_RAMP; i++)
+    out[i] = (int32_t) ((gint64) out[i] * ++filter->faded_in /
+        (TAPDEC_GAP_RAMP + 1));
+}
+
+/* renders up to len samples, taking new pulses from data when the current
+ * one is over */
+static guint
+gst_tapdec_render (GstTapDec * filter, int32_t * out, guint len,
+    const uint32_t * data, uint32_t buflen, uint32_t * bufsofar)
+{
+  guint done = 0;
+
+  while (done < len) {
+    uint32_t nsamples;
+
+    if (filter->cached) {
+      nsamples = MIN (filter->cached_len - filter->cached_pos, len - done);
+      memcpy (out + done, filter->cached + filter->cached_pos,
+          nsamples * sizeof (int32_t));
+      if (filter->faded_in < TAPDEC_GAP_RAMP && filter->cached != filter->ramp)
+        gst_tapdec_fade_in (filter, out + done, nsamples);
+      filter->cached_pos += nsamples;
+      if (filter->cached_pos == filter->cached_len)
+        filter->cached = NULL;
+      done += nsamples;
+      continue;
+    }
+
+    nsamples = tapdec_get_buffer (filter->tap, out + done, len - done);
+    if (filter->faded_in < TAPDEC_GAP_RAMP)
+      gst_tapdec_fade_in (filter, out + done, nsamples);
+    if (nsamples == 0) {
+      if (*bufsofar == buflen)
+        break;
+      /* the ramp before a gap starts from here */
+      if (done > 0)
+        filter->last_sample = out[done - 1];
+      gst_tapdec_next_pulse (filter, data[(*bufsofar)++]);
+    }
+    done += nsamples;
+  }
+  if (done > 0)
+    filter->last_sample = out[done - 1];
+
+  return done;
+}
+
+/* renders the given number of samples, from pulses up to buflen, into as
+ * many output buffers as needed. The base class only takes more than one
+ * buffer per input frame as subframes, since 1.16: before, all samples go
+ * into a single buffer. With the last buffer of the input frame, the frame
+ * is finished */
+static GstFlowReturn
+gst_tapdec_output (GstTapDec * filter, const uint32_t * data,
+    uint32_t buflen, uint32_t * bufsofar, guint64 remaining, gboolean last)
+{
+  GstAudioDecoder *parent = GST_AUDIO_DECODER (filter);
+  guint bpf = GST_AUDIO_INFO_BPF (gst_audio_decoder_get_audio_info (parent));
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  while (remaining > 0) {
+    guint done = 0;
+    GstBuffer *outbuf;
+    GstMapInfo outmap;
+    guint8 *outdata;
+#if GST_CHECK_VERSION(1,16,0)
+    guint samples = (guint) MIN (remaining, filter->pool_samples);
+
+    ret = gst_buffer_pool_acquire_buffer (filter->pool, &outbuf, NULL);
+    if (ret != GST_FLOW_OK)
+      break;
+#else
+    guint samples = (guint) remaining;
+
+    outbuf = gst_audio_decoder_allocate_output_buffer (parent, samples * bpf);
+#endif
+    gst_buffer_map (outbuf, &outmap, GST_MAP_WRITE);
+    outdata = outmap.data;
+    if (filter->pack == NULL)
+      done = gst_tapdec_render (filter, (int32_t *) outdata, samples, data,
+          buflen, bufsofar);
+    else
+      while (done < samples) {
+        guint nsamples = gst_tapdec_render (filter, filter->scratch,
+            MIN (samples - done, TAPDEC_SCRATCH_SIZE), data, buflen,
+            bufsofar);
+
+        if (nsamples == 0)
+          break;
+        filter->pack (filter->scratch, outdata + done * bpf, nsamples);
+        done += nsamples;
+      }
+    gst_buffer_unmap (outbuf, &outmap);
+    gst_buffer_resize (outbuf, 0, done * bpf);
+
+    remaining -= samples;
+#if GST_CHECK_VERSION(1,16,0)
+    if (!last || remaining > 0)
+      ret = gst_audio_decoder_finish_subframe (parent, outbuf);
+    else
+#endif
+      ret = gst_audio_decoder_finish_frame (parent, outbuf, 1);
+    if (ret != GST_FLOW_OK)
+      break;
+  }
+
+  return ret;
+}
+
+/* instead of samples, a gap event, in the same place and with the same
+ * duration. The base class sends the segment with the first buffer, so
+ * before it the gap only delays the timestamps */
+static void
+gst_tapdec_push_gap (GstTapDec * filter, guint64 samples)
+{
+  GstAudioDecoder *parent = GST_AUDIO_DECODER (filter);
+  gint rate = GST_AUDIO_INFO_RATE (gst_audio_decoder_get_audio_info (parent));
+  GstClockTime duration = gst_util_uint64_scale (samples, GST_SECOND, rate);
+  GstClockTime ts = filter->next_ts;
+
+  if (!GST_CLOCK_TIME_IS_VALID (ts))
+    ts = parent->output_segment.start;
+  GST_DEBUG_OBJECT (filter, "gap at %" GST_TIME_FORMAT ", duration %"
+      GST_TIME_FORMAT, GST_TIME_ARGS (ts), GST_TIME_ARGS (duration));
+  filter->gap_offset += duration;
+  filter->next_ts = ts + duration;
+  if (!filter->pushed)
+    return;
+  if (!gst_pad_push_event (GST_AUDIO_DECODER_SRC_PAD (parent),
+          gst_event_new_gap (ts, duration)))
+    GST_DEBUG_OBJECT (filter, "gap event not handled");
+}
+
+/* the base class counts samples, gaps have to be added */
+static GstFlowReturn
+gst_tapdec_pre_push (GstAudioDecoder * dec, GstBuffer ** buffer)
+{
+  GstTapDec *filter = gst_tapdec (dec);
+
+  filter->pushed = TRUE;
+  if (!GST_CLOCK_TIME_IS_VALID (GST_BUFFER_PTS (*buffer)))
+    return GST_FLOW_OK;
+
+  if (filter->gap_offset > 0) {
+    *buffer = gst_buffer_make_writable (*buffer);
+    GST_BUFFER_PTS (*buffer) += filter->gap_offset;
+  }
+  filter->next_ts = GST_BUFFER_PTS (*buffer);
+  if (GST_CLOCK_TIME_IS_VALID (GST_BUFFER_DURATION (*buffer)))
+    filter->next_ts += GST_BUFFER_DURATION (*buffer);
+
+  return GST_FLOW_OK;
+}
+
+static void
+gst_tapdec_flush (GstAudioDecoder * dec, gboolean hard)
+{
+  GstTapDec *filter = gst_tapdec (dec);
+
+  if (hard) {
+    filter->gap_offset = 0;
+    filter->next_ts = GST_CLOCK_TIME_NONE;
+    filter->pushed = FALSE;
+  }
+}
+
+/* every pulse becomes as many samples as its length, because the output
+ * has the same rate as the input: the number of samples in a frame is known
+ * before decoding it, and output buffers are filled up to pool_samples and
+ * no more than needed */
 static GstFlowReturn
 gst_tapdec_handle_frame (GstAudioDecoder * parent, GstBuffer * buf)
 {
   GstTapDec *filter = gst_tapdec (parent);
-  int32_t *data;
-  int32_t *outdata;
+  uint32_t *data;
   uint32_t buflen;
   uint32_t bufsofar;
-  uint32_t total_pulses;
   GstMapInfo map;
-  GstBuffer *outbuf;
-  GstMapInfo outmap;
-  GstMemory *outmemory = NULL;
+  GstFlowReturn ret = GST_FLOW_OK;
+  gboolean finished = FALSE;
 
   if (filter->tap == NULL) {
     GST_ERROR_OBJECT (filter, "not initialised: input not a tape?");
@@ -295,43 +785,44 @@ gst_tapdec_handle_frame (GstAudioDecoder * parent, GstBuffer * buf)
     return GST_FLOW_OK;
   }
 
-  gst_buffer_map (buf, &map, GST_MAP_READ);
-  data = (int32_t *) map.data;
-  buflen = map.size / sizeof (int32_t);
-
-  outbuf = gst_buffer_new ();
-
-  for (bufsofar = 0; bufsofar < buflen; bufsofar++) {
-    uint32_t npulses;
-    tapdec_set_pulse (filter->tap, data[bufsofar]);
-    do {
-      if (outmemory == NULL) {
-        outmemory =
-            gst_allocator_alloc (NULL,
-            TAPDEC_OUTBUF_SIZE * sizeof (int32_t), NULL);
-        total_pulses = 0;
-        gst_memory_map (outmemory, &outmap, GST_MAP_WRITE);
-        outdata = (int32_t *) outmap.data;
-      }
-      npulses =
-          tapdec_get_buffer (filter->tap, outdata + total_pulses,
-          TAPDEC_OUTBUF_SIZE - total_pulses);
-      total_pulses += npulses;
-      if (total_pulses >= TAPDEC_OUTBUF_SIZE) {
-        gst_memory_unmap (outmemory, &outmap);
-        gst_memory_resize (outmemory, 0, total_pulses * sizeof (int32_t));
-        gst_buffer_append_memory (outbuf, outmemory);
-        outmemory = NULL;
-      }
-    } while (npulses > 0);
+  if (filter->pool == NULL && !gst_audio_decoder_negotiate (parent))
+    return GST_FLOW_NOT_NEGOTIATED;
+  if (filter->pool == NULL) {
+    GST_ERROR_OBJECT (filter, "no buffer pool");
+    return GST_FLOW_ERROR;
   }
 
-  if (outmemory != NULL) {
-    gst_memory_unmap (outmemory, &outmap);
-    gst_memory_resize (outmemory, 0, total_pulses * sizeof (int32_t));
-    gst_buffer_append_memory (outbuf, outmemory);
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  data = (uint32_t *) map.data;
+  buflen = map.size / sizeof (uint32_t);
+
+  /* the pulses up to the next gap, then the ramp before it, then the gap */
+  bufsofar = 0;
+  while (bufsofar < buflen && ret == GST_FLOW_OK) {
+    uint32_t end = bufsofar;
+    guint64 remaining = 0;
+    guint64 gap = 0;
+
+    while (end < buflen && !gst_tapdec_is_gap (filter, data[end]))
+      remaining += data[end++];
+    if (end < buflen) {
+      remaining += gst_tapdec_ramp_length (data[end]);
+      gap = data[end] - gst_tapdec_ramp_length (data[end]);
+      end++;
+    }
+    /* the input frame is done with the last output buffer */
+    finished = remaining > 0 && gap == 0 && end == buflen;
+    ret = gst_tapdec_output (filter, data, end, &bufsofar, remaining,
+        finished);
+    if (ret == GST_FLOW_OK && gap > 0)
+      gst_tapdec_push_gap (filter, gap);
+    bufsofar = end;
   }
-  return gst_audio_decoder_finish_frame (parent, outbuf, 1);
+  gst_buffer_unmap (buf, &map);
+
+  if (!finished && ret == GST_FLOW_OK)
+    ret = gst_audio_decoder_finish_frame (parent, NULL, 1);
+  return ret;
 }
 
 
@@ -367,6 +858,20 @@ gst_tapdec_class_init (GstTapDecClass * klass)
       g_param_spec_enum ("waveform", "Waveform",
       "Waveform to be used in output", gst_waveforms_get_type (), TAPDEC_SQUARE,
       G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+  obj_properties[PROP_BUFFER_SIZE] =
+      g_param_spec_uint ("buffer-size", "Buffer size",
+      "Size of the output buffers, in samples. Long pulses are split across several buffers. Takes effect at the next negotiation. Needs GStreamer 1.16 or later, before each input buffer gives a single output buffer",
+      64, G_MAXINT / 8, 32768,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
+  obj_properties[PROP_STATS] =
+      g_param_spec_boxed ("stats", "Statistics",
+      "Hits and misses of the cache of rendered pulses, and the rate of hits",
+      GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+  obj_properties[PROP_GAP_THRESHOLD] =
+      g_param_spec_uint ("gap-threshold", "Gap threshold",
+      "Pulses at least this long, in samples, are not rendered: after a short fade to silence, a gap event is sent instead, and the samples after it fade in. 0 = render all pulses. Needs GStreamer 1.16 or later",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT);
   g_object_class_install_properties (gobject_class, N_PROPERTIES,
       obj_properties);
 
@@ -375,6 +880,9 @@ gst_tapdec_class_init (GstTapDecClass * klass)
   gstaudiodecoder_class->set_format = gst_tapdec_set_format;
   gstaudiodecoder_class->parse = gst_tapdec_parse;
   gstaudiodecoder_class->handle_frame = gst_tapdec_handle_frame;
+  gstaudiodecoder_class->decide_allocation = gst_tapdec_decide_allocation;
+  gstaudiodecoder_class->pre_push = gst_tapdec_pre_push;
+  gstaudiodecoder_class->flush = gst_tapdec_flush;
 }
 
 /* initialize the new element
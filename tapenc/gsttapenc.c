@@ -52,13 +52,30 @@
  * gst-launch -v -m fakesrc ! tapenc ! tapefileenc ! fakesink silent=TRUE
  * ]|
  * </refsect2>
+ *
+ * An "info" source pad can be requested. For each pulse found by the
+ * detector, it carries a record made of a guint64 with the position of the
+ * edge ending the pulse (in units of the output rate), a gint32 with the
+ * peak amplitude of the input during the pulse and a gint32 with the
+ * margin by which the amplitude exceeded the trigger threshold. A negative
+ * or small margin means the pulse was detected with little confidence.
+ * All fields are in native endianness.
+ *
+ * The offset end of each output buffer is the position, in input samples,
+ * of the last trigger in it. tapfileenc saves it in its checkpoint file:
+ * with resume=true and the same checkpoint-file, tapenc starts again from
+ * there, asking upstream to seek if it can, dropping input otherwise.
  */
 
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
 
+#include <string.h>
+#include <math.h>
+
 #include <gst/base/gstbytewriter.h>
+#include <gst/base/gstadapter.h>
 #include <gst/audio/audio.h>
 
 #include "tapencoder.h"
@@ -77,73 +94,1359 @@ GST_DEBUG_CATEGORY_STATIC (gst_tapenc_debug);
 #define GST_IS_TAPENC_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_TAPENC))
 
-typedef struct _GstTapEnc GstTapEnc;
-typedef struct _GstTapEncClass GstTapEncClass;
+typedef struct _GstTapEnc GstTapEnc;
+typedef struct _GstTapEncClass GstTapEncClass;
+typedef struct _GstTapEncChunk GstTapEncChunk;
+typedef struct _GstTapEncCandidate GstTapEncCandidate;
+typedef struct _GstTapEncPulseInfo GstTapEncPulseInfo;
+
+typedef enum
+{
+  TAPENC_INTERPOLATION_LINEAR,
+  TAPENC_INTERPOLATION_CUBIC
+} GstTapEncInterpolation;
+
+/* how far from the trigger a zero crossing is looked for, and how many
+ * samples of the previous buffer are kept to look for it */
+#define TAPENC_EDGE_WINDOW 8
+#define TAPENC_EDGE_HISTORY (TAPENC_EDGE_WINDOW + 2)
+
+/* A part of the input between two stretches of silence, encoded with its
+ * own detector */
+struct _GstTapEncChunk
+{
+  GstAdapter *input;
+  struct tap_enc_t *tap;
+  GArray *pulses;
+  guint64 leading_silence;
+  uint32_t tail;
+  gboolean done;
+};
+
+/* A record on the info pad */
+struct _GstTapEncPulseInfo
+{
+  guint64 position;
+  gint32 peak;
+  gint32 margin;
+};
+
+/* A detector configuration tried by auto-tune */
+struct _GstTapEncCandidate
+{
+  guint min_duration;
+  guchar sensitivity;
+  guchar initial_threshold;
+  gboolean inverted;
+  struct tap_enc_t *tap;
+  GArray *pulses;
+};
+
+struct _GstTapEnc
+{
+  GstElement element;
+
+  GstPad *sinkpad, *srcpad;
+
+  gboolean inverted;
+
+  gboolean halfwaves;
+
+  guchar sensitivity;
+
+  guint min_duration;
+
+  guchar initial_threshold;
+
+  GstBuffer *pull_buffer;
+
+  GstMapInfo map;
+
+  uint32_t buflen;
+  int32_t *data;
+  uint32_t buffer_consumed;
+  struct tap_enc_t *tap;
+  GCond cond;
+  GMutex mutex;
+  gboolean is_eos;
+  /* in pull mode, EOS has been sent on the info pad */
+  gboolean info_eos_sent;
+  gint samplerate;
+
+  guint silence_skip;
+  guint64 silent_samples;
+  guint64 pending_silence;
+  /* the last block was skipped as silence */
+  gboolean in_silence;
+  uint32_t block_end;
+
+  guint threads;
+  gboolean parallel;
+  GThreadPool *pool;
+  GQueue chunks;
+  GstTapEncChunk *current_chunk;
+  guint64 chunk_silence;
+  guint64 carry;
+
+  guint queue_size;
+  gboolean threaded;
+  GQueue queue;
+  GMutex queue_mutex;
+  GCond queue_cond;
+  gboolean queue_flushing;
+  GstFlowReturn queue_flow;
+  GstClockTime queue_latency;
+
+  guint auto_tune;
+  gboolean tuning;
+  guint64 tuned_samples;
+  GPtrArray *candidates;
+  GThreadPool *tune_pool;
+  const int32_t *tune_data;
+  uint32_t tune_len;
+  guint tune_running;
+
+  guint oversample;
+  GstTapEncInterpolation interpolation;
+  guint64 input_offset;
+  int32_t history[TAPENC_EDGE_HISTORY];
+  guint history_len;
+  guint64 trigger_position;
+  guint64 edge_position;
+  gint edge_direction;
+
+  gboolean dc_removal;
+  guint highpass_cutoff;
+  gdouble agc_level;
+  gdouble dc_alpha, dc_mean;
+  gdouble hp_coeff, hp_in, hp_out;
+  gdouble agc_decay, agc_envelope;
+  int32_t *scratch;
+  gsize scratch_len;
+
+  guint64 out_position;
+  gboolean live;
+  GstClockTime max_latency;
+  guint64 since_trigger;
+  guint64 provisional;
+
+  GstPad *infopad;
+  gboolean want_info;
+  GArray *info;
+  guint64 info_position;
+  int32_t info_max, info_min;
+  gint64 info_amplitude;
+
+  gchar *checkpoint_file;
+  gboolean resume;
+  guint64 resume_offset;
+  guint64 input_samples;
+  guint64 last_trigger_sample;
+};
+
+struct _GstTapEncClass
+{
+  GstElementClass parent_class;
+};
+
+enum
+{
+  PROP_0,
+  PROP_MIN_DURATION,
+  PROP_SENSITIVITY,
+  PROP_INVERTED,
+  PROP_HALFWAVES,
+  PROP_INITIAL_THRESHOLD,
+  PROP_SILENCE_SKIP,
+  PROP_THREADS,
+  PROP_QUEUE_SIZE,
+  PROP_QUEUE_LEVEL,
+  PROP_QUEUE_LATENCY,
+  PROP_AUTO_TUNE,
+  PROP_OVERSAMPLE,
+  PROP_INTERPOLATION,
+  PROP_DC_REMOVAL,
+  PROP_HIGHPASS_CUTOFF,
+  PROP_AGC_LEVEL,
+  PROP_LIVE,
+  PROP_MAX_LATENCY,
+  PROP_CHECKPOINT_FILE,
+  PROP_RESUME
+};
+
+/* the capabilities of the inputs and outputs.
+ *
+ * describe the real formats here.
+ */
+static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-raw,"
+        "format=" GST_AUDIO_NE (S32) "," "channels=(int)1")
+    );
+
+static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("audio/x-tap")
+    );
+
+static GstStaticPadTemplate info_factory = GST_STATIC_PAD_TEMPLATE ("info",
+    GST_PAD_SRC,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("application/x-tap-pulse-info")
+    );
+
+#define gst_tapenc_parent_class parent_class
+G_DEFINE_TYPE (GstTapEnc, gst_tapenc, GST_TYPE_ELEMENT);
+
+#define TAPENC_SILENCE_BLOCK 256
+
+#define TAPENC_DEFAULT_MAX_LATENCY (20 * GST_MSECOND)
+
+static GType
+gst_interpolations_get_type (void)
+{
+  static GType interpolations_type = 0;
+
+  if (interpolations_type == 0) {
+    static const GEnumValue interpolations_profiles[] = {
+      {TAPENC_INTERPOLATION_LINEAR, "linear", "Linear interpolation"},
+      {TAPENC_INTERPOLATION_CUBIC, "cubic", "Cubic interpolation"},
+      {0, NULL, NULL},
+    };
+    interpolations_type =
+        g_enum_register_static ("GstTapEncInterpolations",
+        interpolations_profiles);
+  }
+
+  return interpolations_type;
+}
+
+static struct tap_enc_t *
+gst_tapenc_new_detector (GstTapEnc * filter)
+{
+  struct tap_enc_t *tap = tapenc_init2 (filter->min_duration,
+      filter->sensitivity, filter->initial_threshold, filter->inverted);
+  tapenc_toggle_trigger_on_both_edges (tap, filter->halfwaves);
+  return tap;
+}
+
+/* adds the pulses in buf to the output position. The position query reads
+ * it from other threads, so it is only accessed with the object lock */
+static void
+gst_tapenc_count_pulses (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstMapInfo map;
+  const uint32_t *pulses;
+  guint64 total = 0;
+  gsize i;
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  pulses = (const uint32_t *) map.data;
+  for (i = 0; i < map.size / sizeof (uint32_t); i++)
+    total += pulses[i];
+  gst_buffer_unmap (buf, &map);
+
+  GST_OBJECT_LOCK (filter);
+  filter->out_position += total;
+  GST_OBJECT_UNLOCK (filter);
+}
+
+static GstFlowReturn
+gst_tapenc_push (GstTapEnc * filter, GstBuffer * buf)
+{
+  gst_tapenc_count_pulses (filter, buf);
+  return gst_pad_push (filter->srcpad, buf);
+}
+
+/* pushes a buffer of pulses not found by gst_tapenc_get_pulse, stamping it
+ * with the position of its last trigger. Only used when oversample is 1, so
+ * that pulses are in input samples */
+static GstFlowReturn
+gst_tapenc_push_triggers (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstMapInfo map;
+  const uint32_t *pulses;
+  gsize i;
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  pulses = (const uint32_t *) map.data;
+  for (i = 0; i < map.size / sizeof (uint32_t); i++)
+    filter->last_trigger_sample += pulses[i];
+  gst_buffer_unmap (buf, &map);
+  GST_BUFFER_OFFSET_END (buf) = filter->last_trigger_sample;
+
+  return gst_tapenc_push (filter, buf);
+}
+
+/* Live mode.
+ * A pulse is only known when the edge ending it arrives. If no edge comes
+ * for max-latency, a provisional pulse is sent so that downstream is not
+ * left waiting, and it is subtracted from the next pulse. There is no
+ * timer: this is only checked at the end of each input buffer, so the
+ * latency also depends on the size of the buffers from upstream */
+
+static guint64
+gst_tapenc_latency_samples (GstTapEnc * filter)
+{
+  return gst_util_uint64_scale (filter->max_latency, filter->samplerate,
+      GST_SECOND);
+}
+
+/* subtracts the provisional pulses sent so far from pulse. The edge is
+ * always sent, as a pulse of at least 1: if the provisional pulses were
+ * longer than that, what is left of them stays in provisional, and is
+ * subtracted from the next pulses */
+static uint32_t
+gst_tapenc_settle_pulse (GstTapEnc * filter, uint32_t pulse)
+{
+  guint64 paid = MIN (pulse - 1, filter->provisional);
+
+  filter->provisional -= paid;
+  filter->since_trigger = 0;
+  if (filter->provisional > 0)
+    GST_LOG_OBJECT (filter, "%" G_GUINT64_FORMAT " samples of provisional "
+        "pulses still to be paid", filter->provisional);
+  return (uint32_t) (pulse - paid);
+}
+
+/* returns a provisional pulse if max-latency has passed since the last
+ * pulse, 0 otherwise */
+static uint32_t
+gst_tapenc_provisional_pulse (GstTapEnc * filter)
+{
+  guint64 pulse;
+
+  if (filter->since_trigger < MAX (gst_tapenc_latency_samples (filter), 1))
+    return 0;
+
+  pulse = MIN (filter->since_trigger * filter->oversample, G_MAXUINT32);
+  filter->provisional += pulse;
+  filter->since_trigger = 0;
+  return (uint32_t) pulse;
+}
+
+/* Tells whether a block of samples can be skipped without running the
+ * detector on it: it must stay below initial-threshold (which is on the
+ * scale of the 8 most significant bits of a sample), and at least
+ * silence-skip samples of silence must have come before it.
+ * The loop is kept trivial so that the compiler can vectorise it */
+static gboolean
+gst_tapenc_skip_block (GstTapEnc * filter, const int32_t * data,
+    uint32_t len)
+{
+  int32_t threshold = (int32_t) filter->initial_threshold << 24;
+  int32_t max = 0, min = 0;
+  uint32_t i;
+  gboolean skip;
+
+  for (i = 0; i < len; i++) {
+    max = MAX (max, data[i]);
+    min = MIN (min, data[i]);
+  }
+  if (max >= threshold || min <= -threshold) {
+    filter->silent_samples = 0;
+    return FALSE;
+  }
+  skip = filter->silent_samples >= filter->silence_skip;
+  filter->silent_samples += len;
+  return skip;
+}
+
+/* Sub-sample edges.
+ * With oversample > 1, the position of each trigger (the sum of all pulses
+ * so far) is moved to the nearest zero crossing of the input, computed
+ * with sub-sample precision by interpolating between the samples around
+ * it. Pulses are the differences between consecutive positions, rounded
+ * to 1/oversample of a sample, so rounding errors never add up */
+
+static gboolean
+gst_tapenc_sample (GstTapEnc * filter, gint64 index, gdouble * value)
+{
+  gint64 pos = index - (gint64) filter->input_offset;
+
+  if (pos >= 0 && pos < filter->buflen) {
+    *value = filter->data[pos];
+    return TRUE;
+  }
+  if (pos < 0 && -pos <= filter->history_len) {
+    *value = filter->history[filter->history_len + pos];
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/* keeps the last samples of the current buffer, before it goes away */
+static void
+gst_tapenc_keep_history (GstTapEnc * filter)
+{
+  guint keep = MIN (filter->buflen, TAPENC_EDGE_HISTORY);
+  guint old = MIN (filter->history_len, TAPENC_EDGE_HISTORY - keep);
+
+  if (filter->oversample == 1)
+    return;
+
+  memmove (filter->history, filter->history + filter->history_len - old,
+      old * sizeof (int32_t));
+  memcpy (filter->history + old, filter->data + filter->buflen - keep,
+      keep * sizeof (int32_t));
+  filter->history_len = old + keep;
+  filter->input_offset += filter->buflen;
+}
+
+static void
+gst_tapenc_reset_edges (GstTapEnc * filter)
+{
+  filter->input_offset = 0;
+  filter->history_len = 0;
+  filter->trigger_position = 0;
+  filter->edge_position = 0;
+  filter->edge_direction = 0;
+}
+
+/* Finds the root in [0, 1] of the Catmull-Rom spline through p0..p3,
+ * knowing that p1 and p2 have opposite signs. Newton's method, falling
+ * back to bisection when a step leaves the bracket */
+static gdouble
+gst_tapenc_cubic_root (gdouble p0, gdouble p1, gdouble p2, gdouble p3,
+    gdouble t)
+{
+  gdouble c1 = 0.5 * (p2 - p0);
+  gdouble c2 = p0 - 2.5 * p1 + 2 * p2 - 0.5 * p3;
+  gdouble c3 = 0.5 * (p3 - p0) + 1.5 * (p1 - p2);
+  gdouble lo = 0, hi = 1;
+  gint i;
+
+  for (i = 0; i < 8; i++) {
+    gdouble f = p1 + t * (c1 + t * (c2 + t * c3));
+    gdouble df = c1 + t * (2 * c2 + 3 * t * c3);
+
+    if ((f < 0) == (p1 < 0))
+      lo = t;
+    else
+      hi = t;
+    t = df != 0 ? t - f / df : (lo + hi) / 2;
+    if (t <= lo || t >= hi)
+      t = (lo + hi) / 2;
+  }
+
+  return t;
+}
+
+/* Tells whether the input crosses zero between samples index - 1 and
+ * index, in the direction of the previous edges, and where */
+static gboolean
+gst_tapenc_edge_at (GstTapEnc * filter, gint64 index, gdouble * edge)
+{
+  gdouble a, b, before, after, t;
+  gint direction;
+
+  if (!gst_tapenc_sample (filter, index - 1, &a)
+      || !gst_tapenc_sample (filter, index, &b))
+    return FALSE;
+  if (a < 0 && b >= 0)
+    direction = 1;
+  else if (a >= 0 && b < 0)
+    direction = -1;
+  else
+    return FALSE;
+  if (!filter->halfwaves) {
+    if (filter->edge_direction == 0)
+      filter->edge_direction = direction;
+    else if (direction != filter->edge_direction)
+      return FALSE;
+  }
+
+  t = a / (a - b);
+  if (filter->interpolation == TAPENC_INTERPOLATION_CUBIC
+      && gst_tapenc_sample (filter, index - 2, &before)
+      && gst_tapenc_sample (filter, index + 1, &after))
+    t = gst_tapenc_cubic_root (before, a, b, after, t);
+  *edge = index - 1 + t;
+
+  return TRUE;
+}
+
+static uint32_t
+gst_tapenc_advance_edge (GstTapEnc * filter, guint64 position)
+{
+  guint64 pulse;
+
+  if (position <= filter->edge_position)
+    position = filter->edge_position + 1;
+  pulse = position - filter->edge_position;
+  filter->edge_position = position;
+  return (uint32_t) MIN (pulse, G_MAXUINT32);
+}
+
+static uint32_t
+gst_tapenc_refine_pulse (GstTapEnc * filter, uint32_t pulse)
+{
+  gint64 trigger;
+  gint i;
+
+  filter->trigger_position += pulse;
+  trigger = (gint64) filter->trigger_position;
+  for (i = 0; i <= TAPENC_EDGE_WINDOW; i++) {
+    gdouble edge;
+
+    if (gst_tapenc_edge_at (filter, trigger + i, &edge)
+        || (i > 0 && gst_tapenc_edge_at (filter, trigger - i, &edge)))
+      return gst_tapenc_advance_edge (filter,
+          (guint64) (edge * filter->oversample + 0.5));
+  }
+
+  return gst_tapenc_advance_edge (filter,
+      filter->trigger_position * filter->oversample);
+}
+
+/* Pulse info.
+ * While the detector runs, the highest and lowest sample it consumed since
+ * the last pulse are kept. When a pulse is found, its peak amplitude and
+ * the margin over the threshold are computed from them. libtap triggers
+ * when the peak-to-peak amplitude reaches (100 - sensitivity)% of the
+ * previous one, so the margin is the half peak-to-peak amplitude minus
+ * that share of the previous half amplitude */
+
+static void
+gst_tapenc_scan_info (GstTapEnc * filter, const int32_t * data, uint32_t len)
+{
+  int32_t max = filter->info_max, min = filter->info_min;
+  uint32_t i;
+
+  for (i = 0; i < len; i++) {
+    max = MAX (max, data[i]);
+    min = MIN (min, data[i]);
+  }
+  filter->info_max = max;
+  filter->info_min = min;
+}
+
+static void
+gst_tapenc_add_info (GstTapEnc * filter, uint32_t pulse)
+{
+  GstTapEncPulseInfo info;
+  gint64 amplitude = ((gint64) filter->info_max - filter->info_min) / 2;
+  gint64 margin = amplitude -
+      filter->info_amplitude * (100 - filter->sensitivity) / 100;
+
+  filter->info_position += pulse;
+  info.position = filter->info_position;
+  info.peak = MAX (filter->info_max, -(gint64) filter->info_min) > G_MAXINT32 ?
+      G_MAXINT32 : MAX (filter->info_max, -filter->info_min);
+  info.margin = (gint32) CLAMP (margin, G_MININT32, G_MAXINT32);
+  g_array_append_val (filter->info, info);
+
+  filter->info_amplitude = amplitude;
+  filter->info_max = filter->info_min = 0;
+}
+
+static void
+gst_tapenc_reset_info (GstTapEnc * filter)
+{
+  g_array_set_size (filter->info, 0);
+  filter->info_position = 0;
+  filter->info_max = filter->info_min = 0;
+  filter->info_amplitude = 0;
+}
+
+/* returns the records collected so far in a buffer, NULL if there are
+ * none */
+static GstBuffer *
+gst_tapenc_take_info (GstTapEnc * filter)
+{
+  gsize size = filter->info->len * sizeof (GstTapEncPulseInfo);
+  GstBuffer *buf;
+
+  if (size == 0)
+    return NULL;
+
+  buf = gst_buffer_new_wrapped (g_array_free (filter->info, FALSE), size);
+  filter->info = g_array_new (FALSE, FALSE, sizeof (GstTapEncPulseInfo));
+  return buf;
+}
+
+/* sends a buffer of records on the info pad, if any */
+static void
+gst_tapenc_push_info_buffer (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstPad *infopad;
+
+  GST_OBJECT_LOCK (filter);
+  infopad = filter->infopad ? gst_object_ref (filter->infopad) : NULL;
+  GST_OBJECT_UNLOCK (filter);
+
+  if (infopad != NULL) {
+    gst_pad_push (infopad, buf);
+    gst_object_unref (infopad);
+  } else
+    gst_buffer_unref (buf);
+}
+
+/* sends the records collected so far on the info pad, if any */
+static void
+gst_tapenc_push_info (GstTapEnc * filter)
+{
+  GstBuffer *buf = gst_tapenc_take_info (filter);
+
+  if (buf != NULL)
+    gst_tapenc_push_info_buffer (filter, buf);
+}
+
+/* forwards an event on the info pad, if any */
+static void
+gst_tapenc_push_info_event (GstTapEnc * filter, GstEvent * event)
+{
+  GstPad *infopad;
+
+  GST_OBJECT_LOCK (filter);
+  infopad = filter->infopad ? gst_object_ref (filter->infopad) : NULL;
+  GST_OBJECT_UNLOCK (filter);
+
+  if (infopad != NULL) {
+    gst_pad_push_event (infopad, event);
+    gst_object_unref (infopad);
+  } else
+    gst_event_unref (event);
+}
+
+/* Runs the detector on the current input buffer, until it finds a pulse or
+ * reaches the end of the current block.
+ * If silence-skip is not 0, the input is examined in blocks of
+ * TAPENC_SILENCE_BLOCK samples, and the blocks which are part of a long
+ * stretch of silence are skipped. The detector is restarted at the start of
+ * every skipped stretch, even if no pulse was found since the previous one,
+ * as the parallel path gives a fresh detector to every chunk. The pulse
+ * pending before the silence, plus the skipped samples, is added to the
+ * first pulse found after it */
+static void
+gst_tapenc_get_pulse (GstTapEnc * filter, uint32_t * pulse)
+{
+  uint32_t consumed;
+
+  *pulse = 0;
+
+  if (filter->silence_skip == 0)
+    filter->block_end = filter->buflen;
+  else if (filter->buffer_consumed == filter->block_end) {
+    uint32_t len = MIN (TAPENC_SILENCE_BLOCK,
+        filter->buflen - filter->buffer_consumed);
+
+    if (gst_tapenc_skip_block (filter, filter->data + filter->buffer_consumed,
+            len)) {
+      if (!filter->in_silence) {
+        filter->pending_silence += tapenc_flush (filter->tap);
+        tapenc_exit (filter->tap);
+        filter->tap = gst_tapenc_new_detector (filter);
+        filter->in_silence = TRUE;
+      }
+      filter->pending_silence += len;
+      filter->buffer_consumed += len;
+      filter->block_end = filter->buffer_consumed;
+      return;
+    }
+    filter->in_silence = FALSE;
+    filter->block_end = filter->buffer_consumed + len;
+  }
+
+  consumed =
+      tapenc_get_pulse (filter->tap, filter->data + filter->buffer_consumed,
+      filter->block_end - filter->buffer_consumed, pulse);
+  if (filter->want_info)
+    gst_tapenc_scan_info (filter, filter->data + filter->buffer_consumed,
+        consumed);
+  filter->buffer_consumed += consumed;
+  if (*pulse > 0 && filter->pending_silence > 0) {
+    *pulse = (uint32_t) MIN (*pulse + filter->pending_silence, G_MAXUINT32);
+    filter->pending_silence = 0;
+  }
+  filter->last_trigger_sample += *pulse;
+  if (*pulse > 0 && filter->oversample > 1)
+    *pulse = gst_tapenc_refine_pulse (filter, *pulse);
+  if (*pulse > 0 && filter->want_info)
+    gst_tapenc_add_info (filter, *pulse);
+}
+
+static uint32_t
+gst_tapenc_flush (GstTapEnc * filter)
+{
+  guint64 pulse = tapenc_flush (filter->tap) + filter->pending_silence;
+  guint64 provisional = filter->provisional;
+
+  filter->pending_silence = 0;
+  filter->in_silence = FALSE;
+  filter->silent_samples = 0;
+  if (filter->oversample > 1) {
+    if (pulse > 0)
+      pulse = gst_tapenc_advance_edge (filter,
+          (filter->trigger_position + pulse) * filter->oversample);
+    gst_tapenc_reset_edges (filter);
+  }
+  pulse = pulse > provisional ? pulse - provisional : 0;
+  filter->provisional = 0;
+  filter->since_trigger = 0;
+  return (uint32_t) MIN (pulse, G_MAXUINT32);
+}
+
+/* Parallel encoding.
+ * A long stretch of silence restarts the detector (see
+ * gst_tapenc_get_pulse), so the parts of the input between two of them can
+ * be encoded independently, each one with its own detector, and give
+ * exactly the same pulses as encoding the whole input in sequence.
+ * The streaming thread only looks for silence, and cuts the input into
+ * chunks which are encoded by a thread pool. The pulses are pushed
+ * downstream in order, adding to the first pulse of each chunk the pulse
+ * pending at the end of the previous one and the silence in between */
+
+/* Above this size, a chunk is not kept in memory any longer, but encoded
+ * as the input arrives */
+#define TAPENC_MAX_CHUNK_SAMPLES (16 * 1024 * 1024)
+
+static void
+gst_tapenc_detect (struct tap_enc_t *tap, const int32_t * data,
+    uint32_t len, GArray * pulses)
+{
+  uint32_t consumed = 0;
+
+  while (consumed < len) {
+    uint32_t pulse;
+    consumed += tapenc_get_pulse (tap, (int32_t *) data + consumed,
+        len - consumed, &pulse);
+    if (pulse > 0)
+      g_array_append_val (pulses, pulse);
+  }
+}
+
+static void
+gst_tapenc_detect_chunk_input (GstTapEncChunk * chunk)
+{
+  gsize size = gst_adapter_available (chunk->input);
+
+  if (size > 0) {
+    gst_tapenc_detect (chunk->tap, gst_adapter_map (chunk->input, size),
+        size / sizeof (int32_t), chunk->pulses);
+    gst_adapter_unmap (chunk->input);
+    gst_adapter_clear (chunk->input);
+  }
+}
+
+static void
+gst_tapenc_finish_chunk (GstTapEnc * filter, GstTapEncChunk * chunk)
+{
+  chunk->tail = tapenc_flush (chunk->tap);
+  tapenc_exit (chunk->tap);
+  chunk->tap = NULL;
+
+  g_mutex_lock (&filter->mutex);
+  chunk->done = TRUE;
+  g_cond_broadcast (&filter->cond);
+  g_mutex_unlock (&filter->mutex);
+}
+
+/* runs in the thread pool */
+static void
+gst_tapenc_encode_chunk (gpointer data, gpointer user_data)
+{
+  GstTapEncChunk *chunk = data;
+  GstTapEnc *filter = user_data;
+
+  chunk->tap = gst_tapenc_new_detector (filter);
+  gst_tapenc_detect_chunk_input (chunk);
+  gst_tapenc_finish_chunk (filter, chunk);
+}
+
+static void
+gst_tapenc_free_chunk (GstTapEncChunk * chunk)
+{
+  if (chunk->tap)
+    tapenc_exit (chunk->tap);
+  g_object_unref (chunk->input);
+  if (chunk->pulses)
+    g_array_free (chunk->pulses, TRUE);
+  g_slice_free (GstTapEncChunk, chunk);
+}
+
+static void
+gst_tapenc_feed_chunk (GstTapEnc * filter, GstBuffer * buf,
+    const int32_t * data, uint32_t start, uint32_t len)
+{
+  GstTapEncChunk *chunk = filter->current_chunk;
+
+  if (chunk == NULL) {
+    chunk = filter->current_chunk = g_slice_new0 (GstTapEncChunk);
+    chunk->input = gst_adapter_new ();
+    chunk->pulses = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+    chunk->leading_silence = filter->chunk_silence;
+    filter->chunk_silence = 0;
+  }
+
+  if (chunk->tap != NULL) {
+    gst_tapenc_detect (chunk->tap, data + start, len, chunk->pulses);
+    return;
+  }
+
+  gst_adapter_push (chunk->input, gst_buffer_copy_region (buf,
+          GST_BUFFER_COPY_MEMORY, start * sizeof (int32_t),
+          len * sizeof (int32_t)));
+  if (gst_adapter_available (chunk->input) >=
+      TAPENC_MAX_CHUNK_SAMPLES * sizeof (int32_t)) {
+    GST_DEBUG_OBJECT (filter, "no silence for a long time, "
+        "encoding the rest of this chunk in the streaming thread");
+    chunk->tap = gst_tapenc_new_detector (filter);
+    gst_tapenc_detect_chunk_input (chunk);
+  }
+}
+
+static void
+gst_tapenc_close_chunk (GstTapEnc * filter)
+{
+  GstTapEncChunk *chunk = filter->current_chunk;
+
+  filter->current_chunk = NULL;
+  g_mutex_lock (&filter->mutex);
+  g_queue_push_tail (&filter->chunks, chunk);
+  g_mutex_unlock (&filter->mutex);
+
+  if (chunk->tap != NULL)
+    gst_tapenc_finish_chunk (filter, chunk);
+  else
+    g_thread_pool_push (filter->pool, chunk, NULL);
+}
+
+/* Pushes downstream the pulses of the chunks at the head of the queue
+ * which are done. Waits for them as long as more than max_pending chunks
+ * are in the queue */
+static GstFlowReturn
+gst_tapenc_push_chunks (GstTapEnc * filter, guint max_pending)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_mutex_lock (&filter->mutex);
+  while (!g_queue_is_empty (&filter->chunks)) {
+    GstTapEncChunk *chunk = g_queue_peek_head (&filter->chunks);
+    guint64 carry;
+
+    if (!chunk->done) {
+      if (g_queue_get_length (&filter->chunks) <= max_pending)
+        break;
+      g_cond_wait (&filter->cond, &filter->mutex);
+      continue;
+    }
+    g_queue_pop_head (&filter->chunks);
+    g_mutex_unlock (&filter->mutex);
+
+    carry = filter->carry + chunk->leading_silence;
+    if (chunk->pulses->len > 0) {
+      uint32_t *pulses = (uint32_t *) chunk->pulses->data;
+      gsize size = chunk->pulses->len * sizeof (uint32_t);
+
+      pulses[0] = (uint32_t) MIN (pulses[0] + carry, G_MAXUINT32);
+      carry = 0;
+      if (ret == GST_FLOW_OK)
+        ret = gst_tapenc_push_triggers (filter,
+            gst_buffer_new_wrapped (g_array_free (chunk->pulses, FALSE),
+                size));
+      else
+        g_array_free (chunk->pulses, TRUE);
+      chunk->pulses = NULL;
+    }
+    filter->carry = carry + chunk->tail;
+    gst_tapenc_free_chunk (chunk);
+
+    g_mutex_lock (&filter->mutex);
+  }
+  g_mutex_unlock (&filter->mutex);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_tapenc_chain_parallel (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstMapInfo map;
+  const int32_t *data;
+  uint32_t len, pos, fed = 0;
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  data = (const int32_t *) map.data;
+  len = map.size / sizeof (int32_t);
+
+  for (pos = 0; pos < len; pos += TAPENC_SILENCE_BLOCK) {
+    uint32_t block = MIN (TAPENC_SILENCE_BLOCK, len - pos);
+
+    if (gst_tapenc_skip_block (filter, data + pos, block)) {
+      if (pos > fed)
+        gst_tapenc_feed_chunk (filter, buf, data, fed, pos - fed);
+      if (filter->current_chunk != NULL)
+        gst_tapenc_close_chunk (filter);
+      filter->chunk_silence += block;
+      fed = pos + block;
+    }
+  }
+  if (len > fed)
+    gst_tapenc_feed_chunk (filter, buf, data, fed, len - fed);
+
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+
+  return gst_tapenc_push_chunks (filter,
+      2 * g_thread_pool_get_max_threads (filter->pool));
+}
+
+/* encodes what is left at the end of the stream, and returns the last
+ * pulse */
+static uint32_t
+gst_tapenc_finish_parallel (GstTapEnc * filter)
+{
+  guint64 pulse;
+
+  if (filter->current_chunk != NULL)
+    gst_tapenc_close_chunk (filter);
+  gst_tapenc_push_chunks (filter, 0);
+
+  pulse = filter->carry + filter->chunk_silence;
+  filter->carry = filter->chunk_silence = 0;
+  filter->silent_samples = 0;
+  return (uint32_t) MIN (pulse, G_MAXUINT32);
+}
+
+static void
+gst_tapenc_discard_chunks (GstTapEnc * filter)
+{
+  GstTapEncChunk *chunk;
+
+  if (filter->current_chunk != NULL) {
+    gst_tapenc_free_chunk (filter->current_chunk);
+    filter->current_chunk = NULL;
+  }
+
+  g_mutex_lock (&filter->mutex);
+  while ((chunk = g_queue_peek_head (&filter->chunks)) != NULL) {
+    if (!chunk->done) {
+      g_cond_wait (&filter->cond, &filter->mutex);
+      continue;
+    }
+    g_queue_pop_head (&filter->chunks);
+    gst_tapenc_free_chunk (chunk);
+  }
+  g_mutex_unlock (&filter->mutex);
+
+  filter->carry = filter->chunk_silence = 0;
+  filter->silent_samples = 0;
+}
+
+static gboolean
+gst_tapenc_upstream_is_seekable (GstTapEnc * filter)
+{
+  GstQuery *query = gst_query_new_seeking (GST_FORMAT_TIME);
+  gboolean seekable = FALSE;
+
+  if (gst_pad_peer_query (filter->sinkpad, query))
+    gst_query_parse_seeking (query, NULL, &seekable, NULL, NULL);
+  gst_query_unref (query);
+
+  return seekable;
+}
+
+/* Auto-tune.
+ * The first auto-tune seconds of input are given to several detectors with
+ * different settings, running in a thread pool. The detector whose pulse
+ * lengths are most concentrated around a few values wins: its pulses are
+ * pushed downstream, and it goes on with the rest of the input */
+
+#define TAPENC_TUNE_BINS 4096
+#define TAPENC_TUNE_CLUSTERS 3
+#define TAPENC_TUNE_MIN_PULSES 100
+
+static void
+gst_tapenc_add_candidate (GstTapEnc * filter, guint min_duration,
+    guint sensitivity, guint initial_threshold, gboolean inverted)
+{
+  GstTapEncCandidate *candidate = g_slice_new (GstTapEncCandidate);
+
+  candidate->min_duration = min_duration;
+  candidate->sensitivity = (guchar) MIN (sensitivity, 100);
+  candidate->initial_threshold = (guchar) MIN (initial_threshold, 127);
+  candidate->inverted = inverted;
+  candidate->tap = tapenc_init2 (candidate->min_duration,
+      candidate->sensitivity, candidate->initial_threshold,
+      candidate->inverted);
+  tapenc_toggle_trigger_on_both_edges (candidate->tap, filter->halfwaves);
+  candidate->pulses = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+  g_ptr_array_add (filter->candidates, candidate);
+}
+
+static void
+gst_tapenc_free_candidate (GstTapEncCandidate * candidate)
+{
+  if (candidate->tap)
+    tapenc_exit (candidate->tap);
+  if (candidate->pulses)
+    g_array_free (candidate->pulses, TRUE);
+  g_slice_free (GstTapEncCandidate, candidate);
+}
+
+/* runs in the thread pool */
+static void
+gst_tapenc_tune_candidate (gpointer data, gpointer user_data)
+{
+  GstTapEncCandidate *candidate = data;
+  GstTapEnc *filter = user_data;
+
+  gst_tapenc_detect (candidate->tap, filter->tune_data, filter->tune_len,
+      candidate->pulses);
+
+  g_mutex_lock (&filter->mutex);
+  filter->tune_running--;
+  g_cond_broadcast (&filter->cond);
+  g_mutex_unlock (&filter->mutex);
+}
+
+static void
+gst_tapenc_start_tune (GstTapEnc * filter)
+{
+  guint i;
+
+  filter->candidates = g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_tapenc_free_candidate);
+  /* the first candidate has the current settings, and wins ties */
+  for (i = 0; i < 2; i++) {
+    gboolean inverted = i ? !filter->inverted : filter->inverted;
+
+    gst_tapenc_add_candidate (filter, filter->min_duration,
+        filter->sensitivity, filter->initial_threshold, inverted);
+    gst_tapenc_add_candidate (filter, filter->min_duration,
+        0, filter->initial_threshold, inverted);
+    gst_tapenc_add_candidate (filter, filter->min_duration,
+        25, filter->initial_threshold, inverted);
+    gst_tapenc_add_candidate (filter, filter->min_duration,
+        50, filter->initial_threshold, inverted);
+    gst_tapenc_add_candidate (filter, filter->min_duration,
+        filter->sensitivity, filter->initial_threshold / 2, inverted);
+    gst_tapenc_add_candidate (filter, filter->min_duration,
+        filter->sensitivity, filter->initial_threshold * 2, inverted);
+    gst_tapenc_add_candidate (filter,
+        filter->min_duration + filter->samplerate / 20000,
+        filter->sensitivity, filter->initial_threshold, inverted);
+  }
+  filter->tune_pool = g_thread_pool_new (gst_tapenc_tune_candidate, filter,
+      g_get_num_processors (), FALSE, NULL);
+  filter->tuned_samples = 0;
+  filter->tuning = TRUE;
+}
+
+static void
+gst_tapenc_stop_tune (GstTapEnc * filter)
+{
+  g_thread_pool_free (filter->tune_pool, FALSE, TRUE);
+  filter->tune_pool = NULL;
+  g_ptr_array_free (filter->candidates, TRUE);
+  filter->candidates = NULL;
+  filter->tuning = FALSE;
+}
+
+/* Fraction of the pulses whose length is within 1/8 of one of the
+ * TAPENC_TUNE_CLUSTERS most frequent lengths. Tapes use very few pulse
+ * lengths, so the better the detection, the higher it is */
+static gdouble
+gst_tapenc_tune_score (GArray * pulses)
+{
+  guint *histogram = g_new0 (guint, TAPENC_TUNE_BINS);
+  guint i, j, total = 0, in_clusters = 0;
+
+  for (i = 0; i < pulses->len; i++) {
+    uint32_t pulse = g_array_index (pulses, uint32_t, i);
+    if (pulse < TAPENC_TUNE_BINS) {
+      histogram[pulse]++;
+      total++;
+    }
+  }
+
+  for (i = 0; i < TAPENC_TUNE_CLUSTERS && total >= TAPENC_TUNE_MIN_PULSES;
+      i++) {
+    guint peak = 0;
+
+    for (j = 1; j < TAPENC_TUNE_BINS; j++)
+      if (histogram[j] > histogram[peak])
+        peak = j;
+    for (j = peak - peak / 8; j <= MIN (peak + peak / 8, TAPENC_TUNE_BINS - 1);
+        j++) {
+      in_clusters += histogram[j];
+      histogram[j] = 0;
+    }
+  }
+  g_free (histogram);
+
+  return total >= TAPENC_TUNE_MIN_PULSES ? (gdouble) in_clusters / total : 0;
+}
+
+static GstFlowReturn
+gst_tapenc_end_tune (GstTapEnc * filter)
+{
+  GstTapEncCandidate *best = NULL;
+  gdouble best_score = -1;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint i;
+
+  for (i = 0; i < filter->candidates->len; i++) {
+    GstTapEncCandidate *candidate = g_ptr_array_index (filter->candidates, i);
+    gdouble score = gst_tapenc_tune_score (candidate->pulses);
+
+    GST_DEBUG_OBJECT (filter, "sensitivity %u, initial threshold %u, "
+        "min duration %u, %sinverted: %u pulses, score %f",
+        candidate->sensitivity, candidate->initial_threshold,
+        candidate->min_duration, candidate->inverted ? "" : "not ",
+        candidate->pulses->len, score);
+    if (score > best_score) {
+      best = candidate;
+      best_score = score;
+    }
+  }
+
+  tapenc_exit (filter->tap);
+  filter->tap = best->tap;
+  best->tap = NULL;
+  filter->min_duration = best->min_duration;
+  filter->sensitivity = best->sensitivity;
+  filter->initial_threshold = best->initial_threshold;
+  filter->inverted = best->inverted;
+  g_object_notify (G_OBJECT (filter), "min-duration");
+  g_object_notify (G_OBJECT (filter), "sensitivity");
+  g_object_notify (G_OBJECT (filter), "initial-threshold");
+  g_object_notify (G_OBJECT (filter), "inverted");
+
+  gst_element_post_message (GST_ELEMENT_CAST (filter),
+      gst_message_new_element (GST_OBJECT_CAST (filter),
+          gst_structure_new ("tapenc-auto-tune",
+              "min-duration", G_TYPE_UINT, (guint) best->min_duration,
+              "sensitivity", G_TYPE_UINT, (guint) best->sensitivity,
+              "initial-threshold", G_TYPE_UINT,
+              (guint) best->initial_threshold,
+              "inverted", G_TYPE_BOOLEAN, best->inverted,
+              "score", G_TYPE_DOUBLE, best_score, NULL)));
+
+  if (best->pulses->len > 0) {
+    gsize size = best->pulses->len * sizeof (uint32_t);
+    ret = gst_tapenc_push_triggers (filter,
+        gst_buffer_new_wrapped (g_array_free (best->pulses, FALSE), size));
+    best->pulses = NULL;
+  }
+  gst_tapenc_stop_tune (filter);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_tapenc_chain_tune (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstMapInfo map;
+  guint i;
+
+  gst_buffer_map (buf, &map, GST_MAP_READ);
+  filter->tune_data = (const int32_t *) map.data;
+  filter->tune_len = map.size / sizeof (int32_t);
+  filter->tune_running = filter->candidates->len;
+  for (i = 0; i < filter->candidates->len; i++)
+    g_thread_pool_push (filter->tune_pool,
+        g_ptr_array_index (filter->candidates, i), NULL);
+
+  g_mutex_lock (&filter->mutex);
+  while (filter->tune_running > 0)
+    g_cond_wait (&filter->cond, &filter->mutex);
+  g_mutex_unlock (&filter->mutex);
+
+  filter->tuned_samples += filter->tune_len;
+  gst_buffer_unmap (buf, &map);
+  gst_buffer_unref (buf);
+
+  if (filter->tuned_samples >= (guint64) filter->auto_tune * filter->samplerate)
+    return gst_tapenc_end_tune (filter);
+  return GST_FLOW_OK;
+}
+
+/* Pre-conditioning.
+ * DC removal, high-pass filter and automatic gain control are applied to
+ * the input in a single pass, before detection. The result is written over
+ * the input when the buffer is writable, otherwise in a scratch area
+ * reused from buffer to buffer. All three stages are recursive filters, so
+ * the loop runs sample after sample with its state in registers */
 
-struct _GstTapEnc
-{
-  GstElement element;
+/* time constants of the DC estimate and of the release of the AGC */
+#define TAPENC_DC_TIME 0.1
+#define TAPENC_AGC_RELEASE_TIME 0.05
+#define TAPENC_AGC_MAX_GAIN 64.0
 
-  GstPad *sinkpad, *srcpad;
+static gboolean
+gst_tapenc_conditioning_enabled (GstTapEnc * filter)
+{
+  return filter->dc_removal || filter->highpass_cutoff > 0
+      || filter->agc_level > 0;
+}
 
-  gboolean inverted;
+static void
+gst_tapenc_setup_conditioning (GstTapEnc * filter)
+{
+  gdouble rate = filter->samplerate;
 
-  gboolean halfwaves;
+  filter->dc_alpha = 1 - exp (-1 / (TAPENC_DC_TIME * rate));
+  if (filter->highpass_cutoff > 0) {
+    gdouble rc = 1 / (2 * G_PI * filter->highpass_cutoff);
+    filter->hp_coeff = rc / (rc + 1 / rate);
+  }
+  filter->agc_decay = exp (-1 / (TAPENC_AGC_RELEASE_TIME * rate));
+  filter->dc_mean = filter->hp_in = filter->hp_out = 0;
+  filter->agc_envelope = 0;
+}
 
-  guchar sensitivity;
+static void
+gst_tapenc_condition_samples (GstTapEnc * filter, const int32_t * in,
+    int32_t * out, gsize len)
+{
+  const gboolean dc_removal = filter->dc_removal;
+  const gboolean highpass = filter->highpass_cutoff > 0;
+  const gboolean agc = filter->agc_level > 0;
+  const gdouble dc_alpha = filter->dc_alpha;
+  const gdouble hp_coeff = filter->hp_coeff;
+  const gdouble agc_decay = filter->agc_decay;
+  const gdouble agc_target = filter->agc_level * G_MAXINT32;
+  gdouble dc_mean = filter->dc_mean;
+  gdouble hp_in = filter->hp_in, hp_out = filter->hp_out;
+  gdouble envelope = filter->agc_envelope;
+  gsize i;
+
+  for (i = 0; i < len; i++) {
+    gdouble x = in[i];
+
+    if (dc_removal) {
+      dc_mean += (x - dc_mean) * dc_alpha;
+      x -= dc_mean;
+    }
+    if (highpass) {
+      hp_out = hp_coeff * (hp_out + x - hp_in);
+      hp_in = x;
+      x = hp_out;
+    }
+    if (agc) {
+      envelope = MAX (fabs (x), envelope * agc_decay);
+      x *= envelope * TAPENC_AGC_MAX_GAIN > agc_target ?
+          agc_target / envelope : TAPENC_AGC_MAX_GAIN;
+    }
+    out[i] = (int32_t) CLAMP (x, G_MININT32, G_MAXINT32);
+  }
 
-  guint min_duration;
+  filter->dc_mean = dc_mean;
+  filter->hp_in = hp_in;
+  filter->hp_out = hp_out;
+  filter->agc_envelope = envelope;
+}
 
-  guchar initial_threshold;
+/* Returns a buffer holding the conditioned input, taking ownership of buf */
+static GstBuffer *
+gst_tapenc_condition (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstMapInfo in, out;
+  GstBuffer *outbuf;
+  gsize len;
+
+  if (!gst_tapenc_conditioning_enabled (filter))
+    return buf;
+
+  if (gst_buffer_is_writable (buf)) {
+    gst_buffer_map (buf, &in, GST_MAP_READWRITE);
+    gst_tapenc_condition_samples (filter, (const int32_t *) in.data,
+        (int32_t *) in.data, in.size / sizeof (int32_t));
+    gst_buffer_unmap (buf, &in);
+    return buf;
+  }
 
-  GstBuffer *pull_buffer;
+  gst_buffer_map (buf, &in, GST_MAP_READ);
+  len = in.size / sizeof (int32_t);
+  if (filter->parallel) {
+    /* chunks keep their buffers until they are encoded */
+    outbuf = gst_buffer_new_allocate (NULL, len * sizeof (int32_t), NULL);
+    gst_buffer_map (outbuf, &out, GST_MAP_WRITE);
+    gst_tapenc_condition_samples (filter, (const int32_t *) in.data,
+        (int32_t *) out.data, len);
+    gst_buffer_unmap (outbuf, &out);
+  } else {
+    /* the buffer is gone before the next one arrives: condition into the
+     * scratch area, then lend it read-only, so that it is never copied */
+    if (filter->scratch_len < len) {
+      g_free (filter->scratch);
+      filter->scratch = g_new (int32_t, len);
+      filter->scratch_len = len;
+    }
+    gst_tapenc_condition_samples (filter, (const int32_t *) in.data,
+        filter->scratch, len);
+    outbuf = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+        filter->scratch, len * sizeof (int32_t), 0, len * sizeof (int32_t),
+        NULL, NULL);
+  }
+  gst_buffer_unmap (buf, &in);
+  gst_buffer_unref (buf);
 
-  GstMapInfo map;
+  return outbuf;
+}
 
-  uint32_t buflen;
-  int32_t *data;
-  uint32_t buffer_consumed;
-  struct tap_enc_t *tap;
-  GCond cond;
-  GMutex mutex;
-  gboolean is_eos;
-  gint samplerate;
-};
+/* Resume.
+ * The detector state is opaque, so it cannot be saved: a new detector
+ * starts at the last trigger saved, with initial-threshold */
 
-struct _GstTapEncClass
+static void
+gst_tapenc_load_checkpoint (GstTapEnc * filter)
 {
-  GstElementClass parent_class;
-};
+  GKeyFile *checkpoint = g_key_file_new ();
+  GError *error = NULL;
+
+  filter->resume_offset = 0;
+  if (!g_key_file_load_from_file (checkpoint, filter->checkpoint_file,
+          G_KEY_FILE_NONE, &error)) {
+    GST_WARNING_OBJECT (filter, "cannot load checkpoint %s: %s",
+        filter->checkpoint_file, error->message);
+    g_error_free (error);
+  } else if (g_key_file_has_key (checkpoint, "tapenc", "input-offset", NULL))
+    filter->resume_offset =
+        g_key_file_get_uint64 (checkpoint, "tapenc", "input-offset", NULL);
+  g_key_file_free (checkpoint);
+
+  GST_DEBUG_OBJECT (filter, "resuming from sample %" G_GUINT64_FORMAT,
+      filter->resume_offset);
+  filter->last_trigger_sample = filter->resume_offset;
+  filter->input_samples = 0;
+  /* edges are in units of the output rate */
+  filter->trigger_position = filter->resume_offset;
+  filter->edge_position = filter->resume_offset * filter->oversample;
+}
 
-enum
+#if GST_CHECK_VERSION(1,10,0)
+static void
+gst_tapenc_resume_seek (GstElement * element, gpointer user_data)
 {
-  PROP_0,
-  PROP_MIN_DURATION,
-  PROP_SENSITIVITY,
-  PROP_INVERTED,
-  PROP_HALFWAVES,
-  PROP_INITIAL_THRESHOLD
-};
-
-/* the capabilities of the inputs and outputs.
- *
- * describe the real formats here.
- */
-static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
-    GST_PAD_SINK,
-    GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("audio/x-raw,"
-        "format=" GST_AUDIO_NE (S32) "," "channels=(int)1")
-    );
+  GstTapEnc *filter = GST_TAPENC (element);
+  GstClockTime time = gst_util_uint64_scale (filter->resume_offset,
+      GST_SECOND, filter->samplerate);
+
+  GST_DEBUG_OBJECT (filter, "seeking to %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (time));
+  gst_pad_push_event (filter->sinkpad, gst_event_new_seek (1.0,
+          GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_ACCURATE,
+          GST_SEEK_TYPE_SET, time, GST_SEEK_TYPE_NONE, -1));
+}
+#endif
 
-static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
-    GST_PAD_SRC,
-    GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("audio/x-tap")
-    );
+/* how many samples at the beginning of a buffer of len samples come before
+ * the point to resume from */
+static uint32_t
+gst_tapenc_resume_skip (GstTapEnc * filter, uint32_t len)
+{
+  uint32_t skip = 0;
 
-#define gst_tapenc_parent_class parent_class
-G_DEFINE_TYPE (GstTapEnc, gst_tapenc, GST_TYPE_ELEMENT);
+  if (filter->input_samples < filter->resume_offset)
+    skip = (uint32_t) MIN (len, filter->resume_offset - filter->input_samples);
+  filter->input_samples += len;
+  return skip;
+}
 
 static void
 gst_tapenc_sends_caps_event (GstTapEnc *filter) {
@@ -156,7 +1459,7 @@ gst_tapenc_sends_caps_event (GstTapEnc *filter) {
       GST_DEBUG_OBJECT (srccaps, "caps before");
       structure = gst_caps_get_structure (srccaps, 0);
       gst_structure_set (structure,
-          "rate", G_TYPE_INT, filter->samplerate,
+          "rate", G_TYPE_INT, filter->samplerate * (gint) filter->oversample,
           "halfwaves", G_TYPE_BOOLEAN, filter->halfwaves, NULL);
       GST_DEBUG_OBJECT (srccaps, "caps after");
       if (filter->tap)
@@ -183,6 +1486,46 @@ gst_tapenc_set_property (GObject * object, guint prop_id,
     case PROP_INITIAL_THRESHOLD:
       filter->initial_threshold = (guchar) g_value_get_uint (value);
       break;
+    case PROP_SILENCE_SKIP:
+      filter->silence_skip = g_value_get_uint (value);
+      break;
+    case PROP_THREADS:
+      filter->threads = g_value_get_uint (value);
+      break;
+    case PROP_QUEUE_SIZE:
+      filter->queue_size = g_value_get_uint (value);
+      break;
+    case PROP_AUTO_TUNE:
+      filter->auto_tune = g_value_get_uint (value);
+      break;
+    case PROP_OVERSAMPLE:
+      filter->oversample = g_value_get_uint (value);
+      break;
+    case PROP_INTERPOLATION:
+      filter->interpolation = g_value_get_enum (value);
+      break;
+    case PROP_DC_REMOVAL:
+      filter->dc_removal = g_value_get_boolean (value);
+      break;
+    case PROP_HIGHPASS_CUTOFF:
+      filter->highpass_cutoff = g_value_get_uint (value);
+      break;
+    case PROP_AGC_LEVEL:
+      filter->agc_level = g_value_get_double (value);
+      break;
+    case PROP_LIVE:
+      filter->live = g_value_get_boolean (value);
+      break;
+    case PROP_MAX_LATENCY:
+      filter->max_latency = g_value_get_uint64 (value);
+      break;
+    case PROP_CHECKPOINT_FILE:
+      g_free (filter->checkpoint_file);
+      filter->checkpoint_file = g_value_dup_string (value);
+      break;
+    case PROP_RESUME:
+      filter->resume = g_value_get_boolean (value);
+      break;
     case PROP_INVERTED:
     {
       gboolean inverted = g_value_get_boolean (value);
@@ -219,6 +1562,55 @@ gst_tapenc_get_property (GObject * object, guint prop_id,
     case PROP_INITIAL_THRESHOLD:
       g_value_set_uint (value, filter->initial_threshold);
       break;
+    case PROP_SILENCE_SKIP:
+      g_value_set_uint (value, filter->silence_skip);
+      break;
+    case PROP_THREADS:
+      g_value_set_uint (value, filter->threads);
+      break;
+    case PROP_QUEUE_SIZE:
+      g_value_set_uint (value, filter->queue_size);
+      break;
+    case PROP_QUEUE_LEVEL:
+      g_mutex_lock (&filter->queue_mutex);
+      g_value_set_uint (value, g_queue_get_length (&filter->queue));
+      g_mutex_unlock (&filter->queue_mutex);
+      break;
+    case PROP_QUEUE_LATENCY:
+      g_mutex_lock (&filter->queue_mutex);
+      g_value_set_uint64 (value, filter->queue_latency);
+      g_mutex_unlock (&filter->queue_mutex);
+      break;
+    case PROP_AUTO_TUNE:
+      g_value_set_uint (value, filter->auto_tune);
+      break;
+    case PROP_OVERSAMPLE:
+      g_value_set_uint (value, filter->oversample);
+      break;
+    case PROP_INTERPOLATION:
+      g_value_set_enum (value, filter->interpolation);
+      break;
+    case PROP_DC_REMOVAL:
+      g_value_set_boolean (value, filter->dc_removal);
+      break;
+    case PROP_HIGHPASS_CUTOFF:
+      g_value_set_uint (value, filter->highpass_cutoff);
+      break;
+    case PROP_AGC_LEVEL:
+      g_value_set_double (value, filter->agc_level);
+      break;
+    case PROP_LIVE:
+      g_value_set_boolean (value, filter->live);
+      break;
+    case PROP_MAX_LATENCY:
+      g_value_set_uint64 (value, filter->max_latency);
+      break;
+    case PROP_CHECKPOINT_FILE:
+      g_value_set_string (value, filter->checkpoint_file);
+      break;
+    case PROP_RESUME:
+      g_value_set_boolean (value, filter->resume);
+      break;
     case PROP_INVERTED:
       g_value_set_boolean (value, filter->inverted);
       break;
@@ -238,10 +1630,17 @@ gst_tapenc_finalize (GObject * object)
 
   g_mutex_clear (&filter->mutex);
   g_cond_clear (&filter->cond);
+  g_mutex_clear (&filter->queue_mutex);
+  g_cond_clear (&filter->queue_cond);
+  g_free (filter->scratch);
+  g_array_free (filter->info, TRUE);
+  g_free (filter->checkpoint_file);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
+static void gst_tapenc_start_info (GstTapEnc * filter);
+
 static GstStateChangeReturn
 gst_tapenc_change_state (GstElement * object, GstStateChange transition)
 {
@@ -250,7 +1649,18 @@ gst_tapenc_change_state (GstElement * object, GstStateChange transition)
       GST_ELEMENT_CLASS (parent_class)->change_state (object, transition);
 
   switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      if (result != GST_STATE_CHANGE_FAILURE)
+        gst_tapenc_start_info (filter);
+      break;
     case GST_STATE_CHANGE_READY_TO_NULL:
+      if (filter->pool) {
+        gst_tapenc_discard_chunks (filter);
+        g_thread_pool_free (filter->pool, FALSE, TRUE);
+        filter->pool = NULL;
+      }
+      if (filter->tuning)
+        gst_tapenc_stop_tune (filter);
       tapenc_exit (filter->tap);
       filter->tap = NULL;
       break;
@@ -262,7 +1672,8 @@ gst_tapenc_change_state (GstElement * object, GstStateChange transition)
 }
 
 static gboolean
-gst_tapenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+gst_tapenc_handle_sink_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
 {
   GstTapEnc *filter = GST_TAPENC (parent);
 
@@ -270,16 +1681,22 @@ gst_tapenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
     case GST_EVENT_EOS:
       if (GST_PAD_MODE (filter->srcpad) == GST_PAD_MODE_PUSH) {
         if (filter->tap != NULL) {
-          uint32_t flushed_pulses = tapenc_flush (filter->tap);
+          uint32_t flushed_pulses;
+
+          if (filter->tuning)
+            gst_tapenc_end_tune (filter);
+          flushed_pulses = filter->parallel ?
+              gst_tapenc_finish_parallel (filter) : gst_tapenc_flush (filter);
           if (flushed_pulses > 0) {
             GstByteWriter *writer = gst_byte_writer_new ();
             GstBuffer *buffer;
             gst_byte_writer_put_data (writer, (const guint8 *) &flushed_pulses,
                 sizeof (flushed_pulses));
             buffer = gst_byte_writer_free_and_get_buffer (writer);
-            gst_pad_push (filter->srcpad, buffer);
+            gst_tapenc_push (filter, buffer);
           }
         }
+        gst_tapenc_push_info_event (filter, gst_event_ref (event));
       } else {
         g_mutex_lock (&filter->mutex);
         filter->is_eos = TRUE;
@@ -288,7 +1705,36 @@ gst_tapenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
       }
       break;
     case GST_EVENT_FLUSH_STOP:
-      tapenc_flush (filter->tap);
+      if (filter->parallel)
+        gst_tapenc_discard_chunks (filter);
+      gst_tapenc_flush (filter);
+      gst_tapenc_reset_info (filter);
+      gst_tapenc_push_info_event (filter, gst_event_ref (event));
+      filter->info_eos_sent = FALSE;
+      GST_OBJECT_LOCK (filter);
+      filter->out_position = 0;
+      GST_OBJECT_UNLOCK (filter);
+      if (filter->samplerate > 0)
+        gst_tapenc_setup_conditioning (filter);
+      break;
+    case GST_EVENT_SEGMENT:
+    {
+      const GstSegment *segment;
+
+      gst_event_parse_segment (event, &segment);
+      if (segment->format == GST_FORMAT_TIME && filter->samplerate > 0) {
+        filter->input_samples = gst_util_uint64_scale (segment->start,
+            filter->samplerate, GST_SECOND);
+        /* the input, and the detector, start again from here, or from the
+         * point to resume from if it comes later */
+        filter->input_offset = filter->input_samples;
+        filter->history_len = 0;
+        filter->trigger_position =
+            MAX (filter->input_samples, filter->resume_offset);
+        filter->edge_position = filter->trigger_position * filter->oversample;
+        filter->edge_direction = 0;
+      }
+    }
       break;
     case GST_EVENT_CAPS:
     {
@@ -307,8 +1753,46 @@ gst_tapenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
 
       filter->tap = tapenc_init2 (filter->min_duration,
           filter->sensitivity, filter->initial_threshold, filter->inverted);
+      gst_tapenc_reset_edges (filter);
+      gst_tapenc_setup_conditioning (filter);
+      GST_OBJECT_LOCK (filter);
+      filter->out_position = 0;
+      GST_OBJECT_UNLOCK (filter);
+      filter->provisional = 0;
+      filter->since_trigger = 0;
+      gst_tapenc_reset_info (filter);
+      filter->resume_offset = 0;
+      filter->last_trigger_sample = 0;
+      filter->input_samples = 0;
+      if (filter->resume && filter->checkpoint_file != NULL)
+        gst_tapenc_load_checkpoint (filter);
       gst_tapenc_sends_caps_event(filter);
 
+      if (filter->tuning)
+        gst_tapenc_stop_tune (filter);
+      if (filter->auto_tune > 0 && filter->oversample == 1 && !filter->live
+          && filter->resume_offset == 0
+          && GST_PAD_MODE (filter->srcpad) == GST_PAD_MODE_PUSH)
+        gst_tapenc_start_tune (filter);
+
+      filter->parallel = filter->threads != 1 && filter->silence_skip > 0
+          && !filter->tuning && filter->oversample == 1 && !filter->live
+          && filter->resume_offset == 0
+          && GST_PAD_MODE (filter->srcpad) == GST_PAD_MODE_PUSH
+          && gst_tapenc_upstream_is_seekable (filter);
+      if (filter->parallel && filter->pool == NULL)
+        filter->pool = g_thread_pool_new (gst_tapenc_encode_chunk, filter,
+            filter->threads > 0 ? filter->threads : g_get_num_processors (),
+            FALSE, NULL);
+      GST_DEBUG_OBJECT (filter, "parallel encoding %s",
+          filter->parallel ? "on" : "off");
+#if GST_CHECK_VERSION(1,10,0)
+      if (filter->resume_offset > 0
+          && gst_tapenc_upstream_is_seekable (filter))
+        gst_element_call_async (GST_ELEMENT_CAST (filter),
+            gst_tapenc_resume_seek, NULL, NULL);
+#endif
+
       gst_segment_init (&new_segment, GST_FORMAT_TIME);
       new_segment_event = gst_event_new_segment (&new_segment);
       gst_pad_push_event (filter->srcpad, new_segment_event);
@@ -321,6 +1805,98 @@ gst_tapenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
   return gst_pad_event_default (pad, parent, event);
 }
 
+/* Only the main source pad gets the events from the sink pad: the info
+ * pad has its own caps and segment, and gets EOS and flushes explicitly */
+static GstIterator *
+gst_tapenc_iterate_internal_links (GstPad * pad, GstObject * parent)
+{
+  GstTapEnc *filter = GST_TAPENC (parent);
+  GValue val = G_VALUE_INIT;
+  GstIterator *it;
+
+  g_value_init (&val, GST_TYPE_PAD);
+  g_value_set_object (&val, filter->srcpad);
+  it = gst_iterator_new_single (GST_TYPE_PAD, &val);
+  g_value_unset (&val);
+
+  return it;
+}
+
+/* stream-start, caps and segment on the info pad. Deactivating the pad
+ * drops them, so they are sent again every time the element starts */
+static void
+gst_tapenc_start_info (GstTapEnc * filter)
+{
+  GstPad *infopad;
+  GstCaps *caps;
+  GstSegment segment;
+  gchar *stream_id;
+
+  GST_OBJECT_LOCK (filter);
+  infopad = filter->infopad ? gst_object_ref (filter->infopad) : NULL;
+  GST_OBJECT_UNLOCK (filter);
+  if (infopad == NULL)
+    return;
+
+  stream_id = gst_pad_create_stream_id (infopad, GST_ELEMENT_CAST (filter),
+      "info");
+  gst_pad_push_event (infopad, gst_event_new_stream_start (stream_id));
+  g_free (stream_id);
+  caps = gst_static_pad_template_get_caps (&info_factory);
+  gst_pad_push_event (infopad, gst_event_new_caps (caps));
+  gst_caps_unref (caps);
+  gst_segment_init (&segment, GST_FORMAT_BYTES);
+  gst_pad_push_event (infopad, gst_event_new_segment (&segment));
+  gst_object_unref (infopad);
+}
+
+static GstPad *
+gst_tapenc_request_new_pad (GstElement * element, GstPadTemplate * templ,
+    const gchar * name, const GstCaps * caps)
+{
+  GstTapEnc *filter = GST_TAPENC (element);
+  GstPad *infopad;
+
+  GST_OBJECT_LOCK (filter);
+  if (filter->infopad != NULL) {
+    GST_OBJECT_UNLOCK (filter);
+    GST_WARNING_OBJECT (filter, "info pad already requested");
+    return NULL;
+  }
+  GST_OBJECT_UNLOCK (filter);
+
+  infopad = gst_pad_new_from_static_template (&info_factory, "info");
+  gst_pad_use_fixed_caps (infopad);
+  gst_pad_set_active (infopad, TRUE);
+  gst_element_add_pad (element, infopad);
+
+  GST_OBJECT_LOCK (filter);
+  filter->infopad = infopad;
+  filter->want_info = TRUE;
+  GST_OBJECT_UNLOCK (filter);
+  gst_tapenc_start_info (filter);
+
+  return infopad;
+}
+
+static void
+gst_tapenc_release_pad (GstElement * element, GstPad * pad)
+{
+  GstTapEnc *filter = GST_TAPENC (element);
+
+  GST_OBJECT_LOCK (filter);
+  if (pad != filter->infopad) {
+    GST_OBJECT_UNLOCK (filter);
+    return;
+  }
+  filter->infopad = NULL;
+  filter->want_info = FALSE;
+  GST_OBJECT_UNLOCK (filter);
+
+  gst_pad_set_active (pad, FALSE);
+  gst_element_remove_pad (element, pad);
+}
+
 /* initialize the tapencoder's class */
 static void
 gst_tapenc_class_init (GstTapEncClass * klass)
@@ -343,10 +1919,14 @@ gst_tapenc_class_init (GstTapEncClass * klass)
       gst_static_pad_template_get (&src_factory));
   gst_element_class_add_pad_template (gstelement_class,
       gst_static_pad_template_get (&sink_factory));
+  gst_element_class_add_pad_template (gstelement_class,
+      gst_static_pad_template_get (&info_factory));
   gobject_class->set_property = gst_tapenc_set_property;
   gobject_class->get_property = gst_tapenc_get_property;
   gobject_class->finalize = gst_tapenc_finalize;
   gstelement_class->change_state = gst_tapenc_change_state;
+  gstelement_class->request_new_pad = gst_tapenc_request_new_pad;
+  gstelement_class->release_pad = gst_tapenc_release_pad;
 
   g_object_class_install_property (gobject_class, PROP_MIN_DURATION,
       g_param_spec_uint ("min-duration", "Minimum duration",
@@ -371,6 +1951,86 @@ gst_tapenc_class_init (GstTapEncClass * klass)
       g_param_spec_uint ("initial-threshold", "Initial threshold",
           "Level the signal needs to reach to overcome initial noise", 0, 127,
           20, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_SILENCE_SKIP,
+      g_param_spec_uint ("silence-skip", "Silence skip",
+          "Length, in samples, of signal below initial-threshold after which the rest of the silence is skipped without running the detector on it. 0 = never skip",
+          0, UINT_MAX, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_THREADS,
+      g_param_spec_uint ("threads", "Threads",
+          "Number of threads encoding in parallel the parts of the input between long stretches of silence. Only used in push mode, if silence-skip is not 0 and upstream is seekable; in pull mode the input is always encoded in sequence. 0 = one per CPU, 1 = no parallel encoding",
+          0, G_MAXINT, 1,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_QUEUE_SIZE,
+      g_param_spec_uint ("queue-size", "Queue size",
+          "In push mode, maximum number of buffers waiting for the detection thread of this element, which is separate from the upstream streaming thread. 0 = run detection in the upstream streaming thread. Takes effect at the next activation",
+          0, G_MAXINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_QUEUE_LEVEL,
+      g_param_spec_uint ("queue-level", "Queue level",
+          "Number of buffers and events currently waiting for the detection thread",
+          0, G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_QUEUE_LATENCY,
+      g_param_spec_uint64 ("queue-latency", "Queue latency",
+          "Time, in nanoseconds, the last buffer or event spent waiting for the detection thread",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_AUTO_TUNE,
+      g_param_spec_uint ("auto-tune", "Auto-tune",
+          "In push mode, number of seconds at the beginning of the input used to try several values of sensitivity, min-duration, initial-threshold and inverted in parallel. The values giving the most regular pulse lengths are kept, and posted in a tapenc-auto-tune element message. Disables parallel encoding. 0 = off",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_OVERSAMPLE,
+      g_param_spec_uint ("oversample", "Oversample",
+          "Measure pulses in fractions of a sample: each trigger is moved to the nearest zero crossing, interpolated between samples, and the output rate is the input sample rate multiplied by this. Disables parallel encoding and auto-tune. 1 = off",
+          1, 256, 1,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_INTERPOLATION,
+      g_param_spec_enum ("interpolation", "Interpolation",
+          "How zero crossings are interpolated when oversample is more than 1",
+          gst_interpolations_get_type (), TAPENC_INTERPOLATION_LINEAR,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_DC_REMOVAL,
+      g_param_spec_boolean ("dc-removal", "DC removal",
+          "Subtract the average level of the input before detection",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_HIGHPASS_CUTOFF,
+      g_param_spec_uint ("highpass-cutoff", "High-pass cutoff",
+          "Cutoff frequency in Hz of a first-order high-pass filter applied to the input before detection. 0 = off",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_AGC_LEVEL,
+      g_param_spec_double ("agc-level", "AGC level",
+          "Amplify the input before detection so that its peaks reach this fraction of full scale, with a gain of at most 64. Noise in silent parts is amplified too, so silence-skip and initial-threshold may need adjusting. 0 = off",
+          0, 1, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_LIVE,
+      g_param_spec_boolean ("live", "Live",
+          "For live capture, in push mode: report latency, and do not keep downstream waiting more than max-latency for a pulse. Disables parallel encoding and auto-tune",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_MAX_LATENCY,
+      g_param_spec_uint64 ("max-latency", "Maximum latency",
+          "In live mode, time in nanoseconds after which, if no edge has been found, a provisional pulse is sent. It is subtracted from the next pulses, so the total length is unchanged. This is not a timer: it is only checked at the end of each input buffer, so the latency can reach max-latency plus the duration of an input buffer. Keep upstream buffers short to stay within it",
+          0, G_MAXUINT64, TAPENC_DEFAULT_MAX_LATENCY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT));
+  g_object_class_install_property (gobject_class, PROP_CHECKPOINT_FILE,
+      g_param_spec_string ("checkpoint-file", "Checkpoint file",
+          "Checkpoint file written by tapfileenc, to resume from",
+          NULL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+  g_object_class_install_property (gobject_class, PROP_RESUME,
+      g_param_spec_boolean ("resume", "Resume",
+          "Start from the input position saved in checkpoint-file, instead of from the beginning. Disables parallel encoding and auto-tune",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT |
+          GST_PARAM_MUTABLE_READY));
 
   GST_DEBUG_CATEGORY_INIT (gst_tapenc_debug, "tapenc",
       0, "Commodore TAP format encoder");
@@ -378,6 +2038,68 @@ gst_tapenc_class_init (GstTapEncClass * klass)
 
 /* GstElement vmethod implementations */
 
+static GstFlowReturn
+gst_tapenc_chain_sequential (GstTapEnc * filter, GstBuffer * buf)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GstByteWriter *writer = gst_byte_writer_new ();
+  guint size;
+
+  gst_buffer_map (buf, &filter->map, GST_MAP_READ);
+  filter->data = (int32_t *) filter->map.data;
+  filter->buflen = filter->map.size / sizeof (int32_t);
+  filter->buffer_consumed = gst_tapenc_resume_skip (filter, filter->buflen);
+  filter->block_end = filter->buffer_consumed;
+  while (filter->buffer_consumed < filter->buflen) {
+    uint32_t pulse;
+    uint32_t consumed = filter->buffer_consumed;
+
+    gst_tapenc_get_pulse (filter, &pulse);
+    if (filter->live) {
+      filter->since_trigger += filter->buffer_consumed - consumed;
+      if (pulse > 0)
+        pulse = gst_tapenc_settle_pulse (filter, pulse);
+    }
+    if (pulse > 0)
+      gst_byte_writer_put_data (writer, (const guint8 *) &pulse,
+          sizeof (pulse));
+  }
+  if (filter->live) {
+    uint32_t pulse = gst_tapenc_provisional_pulse (filter);
+    if (pulse > 0)
+      gst_byte_writer_put_data (writer, (const guint8 *) &pulse,
+          sizeof (pulse));
+  }
+
+  size = gst_byte_writer_get_size (writer);
+  if (size > 0) {
+    GstBuffer *newbuf = gst_byte_writer_free_and_get_buffer (writer);
+    GST_BUFFER_OFFSET_END (newbuf) = filter->last_trigger_sample;
+    ret = gst_tapenc_push (filter, newbuf);
+  } else
+    gst_byte_writer_free (writer);
+  gst_tapenc_push_info (filter);
+  gst_tapenc_keep_history (filter);
+  gst_buffer_unmap (buf, &filter->map);
+  gst_buffer_unref (buf);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_tapenc_process (GstTapEnc * filter, GstBuffer * buf)
+{
+  buf = gst_tapenc_condition (filter, buf);
+  if (filter->tuning)
+    return gst_tapenc_chain_tune (filter, buf);
+  if (filter->parallel)
+    return gst_tapenc_chain_parallel (filter, buf);
+  return gst_tapenc_chain_sequential (filter, buf);
+}
+
+static GstFlowReturn gst_tapenc_enqueue (GstTapEnc * filter,
+    GstMiniObject * object);
+
 /* chain function
  * this function does the actual processing
  */
@@ -386,56 +2108,184 @@ gst_tapenc_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
 {
   GstTapEnc *filter = GST_TAPENC (GST_OBJECT_PARENT (pad));
   GstFlowReturn ret = GST_FLOW_OK;
-  GstByteWriter *writer = gst_byte_writer_new ();
-  guint size;
-
 
   if (GST_PAD_MODE (filter->srcpad) == GST_PAD_MODE_PULL) {
     g_mutex_lock (&filter->mutex);
 
     while (filter->pull_buffer != NULL)
       g_cond_wait (&filter->cond, &filter->mutex);
+    buf = gst_tapenc_condition (filter, buf);
     filter->pull_buffer = buf;
     gst_buffer_map (buf, &filter->map, GST_MAP_READ);
     filter->data = (int32_t *) filter->map.data;
     filter->buflen = filter->map.size / sizeof (int32_t);
-    filter->buffer_consumed = 0;
+    filter->buffer_consumed = gst_tapenc_resume_skip (filter, filter->buflen);
+    filter->block_end = filter->buffer_consumed;
 
     g_cond_signal (&filter->cond);
     g_mutex_unlock (&filter->mutex);
-  } else {
-    gst_buffer_map (buf, &filter->map, GST_MAP_READ);
-    filter->data = (int32_t *) filter->map.data;
-    filter->buflen = filter->map.size / sizeof (int32_t);
-    filter->buffer_consumed = 0;
-    while (filter->buffer_consumed < filter->buflen) {
-      uint32_t pulse;
-      filter->buffer_consumed +=
-          tapenc_get_pulse (filter->tap, filter->data + filter->buffer_consumed,
-          filter->buflen - filter->buffer_consumed, &pulse);
-      if (pulse > 0)
-        gst_byte_writer_put_data (writer, (const guint8 *) &pulse,
-            sizeof (pulse));
-    }
+  } else if (filter->threaded)
+    ret = gst_tapenc_enqueue (filter, GST_MINI_OBJECT_CAST (buf));
+  else
+    ret = gst_tapenc_process (filter, buf);
+
+  return ret;
+}
+
+/* Detection thread.
+ * With queue-size > 0, in push mode, the chain function and the serialized
+ * events only put their buffer or event in a queue, and a task on the
+ * source pad does detection and pushes downstream */
+
+typedef struct
+{
+  GstMiniObject *object;
+  gint64 queued_at;
+} GstTapEncQueueItem;
+
+static void
+gst_tapenc_clear_queue (GstTapEnc * filter)
+{
+  GstTapEncQueueItem *item;
 
-    size = gst_byte_writer_get_size (writer);
-    if (size > 0) {
-      GstBuffer *newbuf = gst_byte_writer_free_and_get_buffer (writer);
-      ret = gst_pad_push (filter->srcpad, newbuf);
-    } else
-      gst_byte_writer_free (writer);
-    gst_buffer_unmap (buf, &filter->map);
+  while ((item = g_queue_pop_head (&filter->queue)) != NULL) {
+    gst_mini_object_unref (item->object);
+    g_slice_free (GstTapEncQueueItem, item);
   }
+}
+
+static GstFlowReturn
+gst_tapenc_enqueue (GstTapEnc * filter, GstMiniObject * object)
+{
+  GstTapEncQueueItem *item;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&filter->queue_mutex);
+  while (g_queue_get_length (&filter->queue) >= filter->queue_size
+      && !filter->queue_flushing && filter->queue_flow == GST_FLOW_OK)
+    g_cond_wait (&filter->queue_cond, &filter->queue_mutex);
+  ret = filter->queue_flushing ? GST_FLOW_FLUSHING : filter->queue_flow;
+  if (ret == GST_FLOW_OK) {
+    item = g_slice_new (GstTapEncQueueItem);
+    item->object = object;
+    item->queued_at = g_get_monotonic_time ();
+    g_queue_push_tail (&filter->queue, item);
+    g_cond_broadcast (&filter->queue_cond);
+  } else
+    gst_mini_object_unref (object);
+  g_mutex_unlock (&filter->queue_mutex);
 
   return ret;
 }
 
+static void
+gst_tapenc_loop (GstTapEnc * filter)
+{
+  GstTapEncQueueItem *item;
+  GstMiniObject *object;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_mutex_lock (&filter->queue_mutex);
+  while (g_queue_is_empty (&filter->queue) && !filter->queue_flushing)
+    g_cond_wait (&filter->queue_cond, &filter->queue_mutex);
+  if (filter->queue_flushing) {
+    g_mutex_unlock (&filter->queue_mutex);
+    gst_pad_pause_task (filter->srcpad);
+    return;
+  }
+  item = g_queue_pop_head (&filter->queue);
+  filter->queue_latency =
+      (g_get_monotonic_time () - item->queued_at) * GST_USECOND;
+  g_cond_broadcast (&filter->queue_cond);
+  g_mutex_unlock (&filter->queue_mutex);
+
+  object = item->object;
+  g_slice_free (GstTapEncQueueItem, item);
+  if (GST_IS_BUFFER (object))
+    ret = gst_tapenc_process (filter, GST_BUFFER_CAST (object));
+  else
+    gst_tapenc_handle_sink_event (filter->sinkpad, GST_OBJECT_CAST (filter),
+        GST_EVENT_CAST (object));
+
+  if (ret == GST_FLOW_OK)
+    return;
+
+  GST_DEBUG_OBJECT (filter, "pausing task, reason %s",
+      gst_flow_get_name (ret));
+  g_mutex_lock (&filter->queue_mutex);
+  filter->queue_flow = ret;
+  g_cond_broadcast (&filter->queue_cond);
+  g_mutex_unlock (&filter->queue_mutex);
+  gst_pad_pause_task (filter->srcpad);
+  if (ret == GST_FLOW_NOT_LINKED || ret < GST_FLOW_EOS) {
+    GST_ELEMENT_FLOW_ERROR (filter, ret);
+    gst_pad_push_event (filter->srcpad, gst_event_new_eos ());
+  }
+}
+
+static gboolean
+gst_tapenc_start_queue (GstTapEnc * filter)
+{
+  g_mutex_lock (&filter->queue_mutex);
+  filter->queue_flushing = FALSE;
+  filter->queue_flow = GST_FLOW_OK;
+  g_mutex_unlock (&filter->queue_mutex);
+
+  return gst_pad_start_task (filter->srcpad, (GstTaskFunction) gst_tapenc_loop,
+      filter, NULL);
+}
+
+static void
+gst_tapenc_flush_queue (GstTapEnc * filter)
+{
+  g_mutex_lock (&filter->queue_mutex);
+  filter->queue_flushing = TRUE;
+  gst_tapenc_clear_queue (filter);
+  g_cond_broadcast (&filter->queue_cond);
+  g_mutex_unlock (&filter->queue_mutex);
+}
+
+static gboolean
+gst_tapenc_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstTapEnc *filter = GST_TAPENC (parent);
+  gboolean ret;
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START)
+    gst_tapenc_push_info_event (filter, gst_event_ref (event));
+
+  if (!filter->threaded)
+    return gst_tapenc_handle_sink_event (pad, parent, event);
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_FLUSH_START:
+      gst_tapenc_flush_queue (filter);
+      ret = gst_pad_event_default (pad, parent, event);
+      gst_pad_pause_task (filter->srcpad);
+      return ret;
+    case GST_EVENT_FLUSH_STOP:
+      g_mutex_lock (&filter->queue_mutex);
+      gst_tapenc_clear_queue (filter);
+      g_mutex_unlock (&filter->queue_mutex);
+      ret = gst_tapenc_handle_sink_event (pad, parent, event);
+      gst_tapenc_start_queue (filter);
+      return ret;
+    default:
+      if (GST_EVENT_IS_SERIALIZED (event))
+        return gst_tapenc_enqueue (filter,
+            GST_MINI_OBJECT_CAST (event)) == GST_FLOW_OK;
+      return gst_tapenc_handle_sink_event (pad, parent, event);
+  }
+}
+
 static GstFlowReturn
 gst_tapenc_get_range (GstPad * pad,
     GstObject * parent, guint64 offset, guint length, GstBuffer ** buf)
 {
   GstTapEnc *filter = GST_TAPENC (GST_OBJECT_PARENT (pad));
   GstByteWriter *writer = gst_byte_writer_new ();
+  GstBuffer *info;
+  gboolean info_eos = FALSE;
 
   g_mutex_lock (&filter->mutex);
 
@@ -447,15 +2297,20 @@ gst_tapenc_get_range (GstPad * pad,
       g_cond_wait (&filter->cond, &filter->mutex);
     if (filter->pull_buffer == NULL) {
       if (gst_byte_writer_get_size (writer) < length) {
-        pulse = tapenc_flush (filter->tap);
+        pulse = gst_tapenc_flush (filter);
         if (pulse > 0)
           gst_byte_writer_put_data (writer, (const guint8 *) &pulse,
               sizeof (pulse));
       }
+      /* the push paths forward EOS on the info pad, this one has to send
+       * it once the last records are out */
+      info_eos = !filter->info_eos_sent;
+      filter->info_eos_sent = TRUE;
       break;
     }
 
     if (filter->buflen <= filter->buffer_consumed) {
+      gst_tapenc_keep_history (filter);
       gst_buffer_unmap (filter->pull_buffer, &filter->map);
       gst_buffer_unref (filter->pull_buffer);
       filter->pull_buffer = NULL;
@@ -467,19 +2322,49 @@ gst_tapenc_get_range (GstPad * pad,
     if (gst_byte_writer_get_size (writer) >= length)
       break;
 
-    filter->buffer_consumed +=
-        tapenc_get_pulse (filter->tap, filter->data + filter->buffer_consumed,
-        filter->buflen - filter->buffer_consumed, &pulse);
+    gst_tapenc_get_pulse (filter, &pulse);
     if (pulse > 0)
       gst_byte_writer_put_data (writer, (const guint8 *) &pulse,
           sizeof (pulse));
   } while (1);
 
+  /* nothing is pushed downstream with the mutex held, or chain would be
+   * blocked until it is through */
+  info = gst_tapenc_take_info (filter);
   g_mutex_unlock (&filter->mutex);
+  if (info != NULL)
+    gst_tapenc_push_info_buffer (filter, info);
+  if (info_eos)
+    gst_tapenc_push_info_event (filter, gst_event_new_eos ());
   *buf = gst_byte_writer_free_and_get_buffer (writer);
+  GST_BUFFER_OFFSET_END (*buf) = filter->last_trigger_sample;
+  gst_tapenc_count_pulses (filter, *buf);
   return GST_FLOW_OK;
 }
 
+/* converts between TIME and DEFAULT, which is output rate units, that is,
+ * the units pulses are measured in */
+static gboolean
+gst_tapenc_convert (GstTapEnc * filter, GstFormat src_format,
+    gint64 src_value, GstFormat * dest_format, gint64 * dest_value)
+{
+  guint64 rate = (guint64) filter->samplerate * filter->oversample;
+
+  if (src_format == *dest_format) {
+    *dest_value = src_value;
+    return TRUE;
+  }
+  if (rate == 0 || src_value < 0)
+    return FALSE;
+  if (src_format == GST_FORMAT_DEFAULT && *dest_format == GST_FORMAT_TIME)
+    *dest_value = gst_util_uint64_scale (src_value, GST_SECOND, rate);
+  else if (src_format == GST_FORMAT_TIME && *dest_format == GST_FORMAT_DEFAULT)
+    *dest_value = gst_util_uint64_scale (src_value, rate, GST_SECOND);
+  else
+    return FALSE;
+  return TRUE;
+}
+
 static gboolean
 gst_tapenc_query (GstPad * pad, GstObject * parent, GstQuery * query)
 {
@@ -494,8 +2379,79 @@ gst_tapenc_query (GstPad * pad, GstObject * parent, GstQuery * query)
     case GST_QUERY_POSITION:
     {
       GstTapEnc *filter = GST_TAPENC (parent);
-      gint64 pos = (gint64) tapenc_get_last_trigger (filter->tap);
-      gst_query_set_position (query, GST_FORMAT_BYTES, pos);
+      GstFormat format;
+      gint64 pos;
+      guint64 out_position;
+
+      gst_query_parse_position (query, &format, NULL);
+      if (format == GST_FORMAT_BYTES) {
+        pos = (gint64) tapenc_get_last_trigger (filter->tap);
+        gst_query_set_position (query, GST_FORMAT_BYTES, pos);
+        return TRUE;
+      }
+      GST_OBJECT_LOCK (filter);
+      out_position = filter->out_position;
+      GST_OBJECT_UNLOCK (filter);
+      if (!gst_tapenc_convert (filter, GST_FORMAT_DEFAULT,
+              (gint64) out_position, &format, &pos))
+        return FALSE;
+      gst_query_set_position (query, format, pos);
+    }
+      return TRUE;
+    case GST_QUERY_DURATION:
+    {
+      GstTapEnc *filter = GST_TAPENC (parent);
+      GstFormat format;
+      gint64 duration;
+
+      gst_query_parse_duration (query, &format, NULL);
+      if (format != GST_FORMAT_DEFAULT)
+        return gst_pad_query_default (pad, parent, query);
+      if (!gst_pad_peer_query_duration (filter->sinkpad, GST_FORMAT_TIME,
+              &duration)
+          || !gst_tapenc_convert (filter, GST_FORMAT_TIME, duration, &format,
+              &duration))
+        return FALSE;
+      gst_query_set_duration (query, format, duration);
+    }
+      return TRUE;
+    case GST_QUERY_CONVERT:
+    {
+      GstTapEnc *filter = GST_TAPENC (parent);
+      GstFormat src_format, dest_format;
+      gint64 src_value, dest_value;
+
+      gst_query_parse_convert (query, &src_format, &src_value, &dest_format,
+          NULL);
+      if (!gst_tapenc_convert (filter, src_format, src_value, &dest_format,
+              &dest_value))
+        return FALSE;
+      gst_query_set_convert (query, src_format, src_value, dest_format,
+          dest_value);
+    }
+      return TRUE;
+    case GST_QUERY_LATENCY:
+    {
+      GstTapEnc *filter = GST_TAPENC (parent);
+      gboolean live;
+      GstClockTime min, max, latency;
+
+      if (!filter->live || filter->samplerate == 0)
+        return gst_pad_query_default (pad, parent, query);
+      if (!gst_pad_peer_query (filter->sinkpad, query))
+        return FALSE;
+      gst_query_parse_latency (query, &live, &min, &max);
+      /* a pulse needs min-duration samples to be confirmed, and is sent
+       * at the latest max-latency after its start */
+      latency = filter->max_latency +
+          gst_util_uint64_scale (filter->min_duration, GST_SECOND,
+          filter->samplerate);
+      GST_DEBUG_OBJECT (filter, "our latency: %" GST_TIME_FORMAT,
+          GST_TIME_ARGS (latency));
+      min += latency;
+      if (max != GST_CLOCK_TIME_NONE)
+        max += latency;
+      gst_query_set_latency (query, live, min, max);
     }
       return TRUE;
     default:
@@ -532,6 +2488,15 @@ gst_tapenc_src_activate_mode (GstPad * pad, GstObject * parent,
         result =
           gst_pad_activate_mode (trans->sinkpad, GST_PAD_MODE_PULL, active);
     }
+  } else if (mode == GST_PAD_MODE_PUSH) {
+    if (active && trans->queue_size > 0) {
+      result = gst_tapenc_start_queue (trans);
+      trans->threaded = result;
+    } else if (!active && trans->threaded) {
+      gst_tapenc_flush_queue (trans);
+      result = gst_pad_stop_task (pad);
+      trans->threaded = FALSE;
+    }
   }
 
   return result;
@@ -550,6 +2515,8 @@ gst_tapenc_init (GstTapEnc * filter)
       GST_DEBUG_FUNCPTR (gst_tapenc_chain));
   gst_pad_set_event_function (filter->sinkpad,
       GST_DEBUG_FUNCPTR (gst_tapenc_sink_event));
+  gst_pad_set_iterate_internal_links_function (filter->sinkpad,
+      GST_DEBUG_FUNCPTR (gst_tapenc_iterate_internal_links));
 
   filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
   gst_pad_set_getrange_function (filter->srcpad, gst_tapenc_get_range);
@@ -561,6 +2528,11 @@ gst_tapenc_init (GstTapEnc * filter)
 
   g_mutex_init (&filter->mutex);
   g_cond_init (&filter->cond);
+  g_queue_init (&filter->chunks);
+  g_mutex_init (&filter->queue_mutex);
+  g_cond_init (&filter->queue_cond);
+  g_queue_init (&filter->queue);
+  filter->info = g_array_new (FALSE, FALSE, sizeof (GstTapEncPulseInfo));
 }
 
 static gboolean